@@ -0,0 +1,32 @@
+// Minimal poll + update sketch used to measure the client footprint per
+// feature set, see the footprint_* environments in platformio.ini
+
+#include <Arduino.h>
+#include <OtamClient.h>
+#include <WiFi.h>
+
+OtamConfig config;
+OtamClient* otamClient;
+
+void setup() {
+    WiFi.begin("ssid", "password");
+    while (WiFi.status() != WL_CONNECTED) {
+        delay(500);
+    }
+
+    config.url = "http://otam.local/api";
+    config.apiKey = "api-key";
+    config.deviceId = "footprint";
+    config.deviceProfileId = 1;
+
+    otamClient = new OtamClient(config);
+    otamClient->initialize();
+}
+
+void loop() {
+    if (otamClient->hasPendingUpdate()) {
+        otamClient->doFirmwareUpdate();
+        ESP.restart();
+    }
+    delay(60000);
+}
@@ -2,49 +2,179 @@
 #define OTAM_CLIENT_H
 
 #include <HTTPClient.h>
+#include <esp_timer.h>
+#include "internal/OtamCapture.h"
 #include "internal/OtamConfig.h"
 #include "internal/OtamDevice.h"
+#include "internal/OtamFeatures.h"
 #include "internal/OtamHttp.h"
+#include "internal/OtamTrace.h"
+#if OTAM_ENABLE_PEERS
+#include "internal/OtamPeerServer.h"
+#endif
+#if OTAM_ENABLE_SPOOL
+#include "internal/OtamSpool.h"
+#endif
+#if OTAM_ENABLE_VITALS
+#include "internal/OtamVitals.h"
+#endif
+
+// Task that reverts an image which missed its health check deadline
+#ifndef OTAM_REVERT_TASK_STACK_SIZE
+#define OTAM_REVERT_TASK_STACK_SIZE 4096
+#endif
+#ifndef OTAM_REVERT_TASK_PRIORITY
+#define OTAM_REVERT_TASK_PRIORITY 5
+#endif
 
 struct FirmwareUpdateValues {
     int firmwareFileId;
     int firmwareId;
+#if OTAM_ENABLE_FIRMWARE_STRINGS
     String firmwareName;
     String firmwareVersion;
+#endif
+    String firmwareFileUrl;                       // download url prefetched with the status poll
+    int firmwareFileSize = 0;                     // advertised firmware file size in bytes, 0 if unknown
+    String firmwareFileHash;                      // advertised firmware file MD5 (hex), empty if unknown
+    unsigned long firmwareFileUrlExpiresAt = 0;  // millis() when the prefetched url expires, 0 if never
+};
+
+#if OTAM_ENABLE_MIRRORS
+struct OtamMirrorStats {
+    int timeToFirstByte = -1;  // probe result in ms, -1 if not probed or unreachable
+    uint32_t bytes = 0;        // image bytes downloaded from the mirror
+    uint32_t durationMs = 0;   // time spent downloading from the mirror
 };
+#endif
 
 class OtamClient {
    private:
     OtamConfig clientOtamConfig;
-    OtamDevice* otamDevice;
+    OtamDevice* otamDevice = nullptr;
     bool deviceInitialized = false;
     bool updateStarted = false;
     FirmwareUpdateValues firmwareUpdateValues;
+    OtamThrottle downloadThrottle;
+    volatile bool pendingVerification = false;
+    volatile bool verificationExpired = false;  // the revert task could not be started
+    portMUX_TYPE verificationMux = portMUX_INITIALIZER_UNLOCKED;
+    esp_timer_handle_t bootValidationTimer = nullptr;
+#if OTAM_ENABLE_PEERS
+    static const int maxFirmwarePeers = 4;
+    String firmwarePeers[maxFirmwarePeers];
+    int firmwarePeerCount = 0;
+    OtamPeerServer peerServer;
+#endif
+#if OTAM_ENABLE_MIRRORS
+    static const int maxFirmwareMirrors = 4;
+    String firmwareMirrors[maxFirmwareMirrors];
+    int firmwareMirrorCount = 0;
+    int firmwareMirrorOrder[maxFirmwareMirrors];
+    OtamMirrorStats mirrorStats[maxFirmwareMirrors];
+#endif
+#if OTAM_ENABLE_SPOOL
+    OtamSpool reportSpool;
+#endif
+#if OTAM_ENABLE_VITALS
+    OtamVitals deviceVitals;
+#endif
+    // Figures of the last download for the UPDATE_SUCCESS report, kept in NVS
+    // while the new image waits for confirmHealthy
+    struct UpdateStats {
+        OtamDownloadStats download;
+#if OTAM_ENABLE_MIRRORS
+        int mirrorCount = 0;
+        OtamMirrorStats mirrors[maxFirmwareMirrors];
+#endif
+    };
+#if OTAM_ENABLE_LOG_UPLOAD
+    static const int maxQueuedLogs = 8;
+    String queuedLogs[maxQueuedLogs];
+    int queuedLogCount = 0;
+    void dropQueuedLogs(int count);
+#endif
+    bool syncUnsupported = false;
+    OtamHttpResponse postReport(String url, OtamPayload& payload);
+    void startDevice();
+    bool applyDeviceStatus(OtamPayloadReader& status);
+    boolean syncSeparately();
     void sendOtaUpdateError(String logMessage);
+    void failFirmwareUpdate(String error);
+    bool firmwareFileUrlExpired();
+    String toAbsoluteUrl(String url);
+    String requestFirmwareFileUrl(String& error);
+    bool runFirmwareUpdate(bool activate);
+    bool downloadFirmware(OtamUpdater& otamUpdater, String url, bool sendApiKey, int& httpCode,
+                          String& error);
+    bool finishFirmwareDownload(OtamUpdater& otamUpdater, bool activate);
+    void collectFirmwarePeers();
+    void recordPeerImage(OtamUpdater& otamUpdater);
+#if OTAM_ENABLE_MIRRORS
+    void probeFirmwareMirrors();
+    bool downloadFromMirrors(OtamUpdater& otamUpdater, String& error);
+#endif
+    void storeFirmwareUpdateValues();
+    FirmwareUpdateValues readStoredFirmwareUpdateValues();
+    UpdateStats collectUpdateStats();
+    void postFirmwareUpdateSuccess(const UpdateStats& stats);
+    void completeFirmwareUpdate();
+    void stageFirmwareUpdate(String partitionLabel);
+    void clearStagedUpdate();
+    void beginBootValidation();
+    static void onBootValidationTimeout(void* arg);
+    static void bootValidationRevertTask(void* arg);
+    bool takePendingVerification();
+    void handleVerificationTimeout();
+    bool isUpdateBeingVerified();
+    void revertFirmwareUpdate(String reason);
+    void reportFirmwareRollback();
 
    public:
     explicit OtamClient(const OtamConfig& config);
-    using EmptyCallbackType = std::function<void()>;
-    using NumberCallbackType = std::function<void(int)>;
-    using SuccessCallbackType = std::function<void(FirmwareUpdateValues)>;
-    using ErrorCallbackType = std::function<void(FirmwareUpdateValues, String)>;
-    NumberCallbackType otaDownloadProgressCallback;
-    EmptyCallbackType otaBeforeDownloadCallback;
-    EmptyCallbackType otaAfterDownloadCallback;
-    EmptyCallbackType otaBeforeRebootCallback;
-    SuccessCallbackType otaSuccessCallback;
-    ErrorCallbackType otaErrorCallback;
+#if OTAM_ENABLE_CALLBACKS
+    using EmptyCallbackType = OtamCallback<>;
+    using NumberCallbackType = OtamCallback<int>;
+    using SuccessCallbackType = OtamCallback<FirmwareUpdateValues>;
+    using ErrorCallbackType = OtamCallback<FirmwareUpdateValues, String>;
+    NumberCallbackType otaDownloadProgressCallback = nullptr;
+    EmptyCallbackType otaBeforeDownloadCallback = nullptr;
+    EmptyCallbackType otaAfterDownloadCallback = nullptr;
+    EmptyCallbackType otaBeforeRebootCallback = nullptr;
+    SuccessCallbackType otaSuccessCallback = nullptr;
+    ErrorCallbackType otaErrorCallback = nullptr;
     void onOtaDownloadProgress(NumberCallbackType progressCallback);
     void onOtaBeforeDownload(EmptyCallbackType beforeDownloadCallback);
     void onOtaAfterDownload(EmptyCallbackType afterDownloadCallback);
     void onOtaBeforeReboot(EmptyCallbackType beforeRebootCallback);
     void onOtaSuccess(SuccessCallbackType successCallback);
     void onOtaError(ErrorCallbackType errorCallback);
+#endif
     bool isInitialized();
     void initialize();
+    bool confirmHealthy();
+    bool isPendingVerification();
+#if OTAM_ENABLE_LOG_UPLOAD
     OtamHttpResponse logDeviceMessage(String message);
+    void queueDeviceMessage(String message);
+#endif
     boolean hasPendingUpdate();
+    boolean sync();
     void doFirmwareUpdate();
+    bool stageUpdate();
+    bool hasStagedUpdate();
+    void activateUpdate();
+    void setApplicationBusy(bool busy);
+    OtamDownloadStats getDownloadStats();
+#if OTAM_ENABLE_PEERS
+    void handlePeerRequests();
+#endif
+#if OTAM_ENABLE_DNS_CACHE
+    OtamDnsStats getDnsStats();
+#endif
+#if OTAM_ENABLE_SPOOL
+    int getSpooledReportCount();
+#endif
 };
 
 #endif  // OTAM_CLIENT_H
@@ -0,0 +1,54 @@
+#ifndef LIGHT_CBOR_H
+#define LIGHT_CBOR_H
+
+#include <Arduino.h>
+
+// Allocation-free CBOR (RFC 8949) encoder writing into a caller owned buffer.
+// Every open map or array keeps a byte reserved for its closing break, strings
+// are cut short to fit and anything else that does not fit sets the overflow.
+class LightCborWriter {
+   private:
+    uint8_t* buffer;
+    size_t capacity;
+    size_t length = 0;
+    size_t openContainers = 0;
+    bool overflowed = false;
+    static size_t headSize(uint32_t value);
+    size_t available() const;
+    void writeHead(uint8_t majorType, uint32_t value);
+    void writeBytes(const uint8_t* data, size_t size);
+    void beginContainer(uint8_t majorType);
+
+   public:
+    LightCborWriter(uint8_t* buffer, size_t capacity);
+    void beginMap();
+    void beginArray();
+    void end();
+    void addInt(int32_t value);
+    void addString(const char* value);
+    void addString(const char* value, size_t size);
+    size_t size() const;
+    size_t remaining() const;
+    bool ok() const;
+    void rollback(size_t mark);
+};
+
+// Allocation-free lookup of top level map entries in a CBOR document. Keys
+// match either their integer field id or their text name.
+class LightCbor {
+   public:
+    static String getValue(const uint8_t* data, size_t size, int keyId, const char* keyName);
+    static int getIntValue(const uint8_t* data, size_t size, int keyId, const char* keyName);
+    static bool hasKey(const uint8_t* data, size_t size, int keyId, const char* keyName);
+    static String getArrayItem(const uint8_t* data, size_t size, int keyId, const char* keyName, int index);
+
+   private:
+    static const uint8_t* readHead(const uint8_t* current, const uint8_t* end, uint8_t& majorType,
+                                   uint32_t& value, bool& indefinite);
+    static const uint8_t* skipItem(const uint8_t* current, const uint8_t* end, int depth);
+    static bool keyMatches(const uint8_t* current, const uint8_t* end, int keyId, const char* keyName);
+    static const uint8_t* findValue(const uint8_t* data, size_t size, int keyId, const char* keyName);
+    static String itemToString(const uint8_t* current, const uint8_t* end);
+};
+
+#endif  // LIGHT_CBOR_H
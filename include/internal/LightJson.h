@@ -8,6 +8,7 @@ class LightJson {
     static String getValue(const char* json, const char* key);
     static int getIntValue(const char* json, const char* key);
     static bool hasKey(const char* json, const char* key);
+    static String getArrayItem(const char* json, const char* key, int index);
     static String createObject(const char* key, const char* value);
     static String createObject(const char* key, int value);
     static String createObject(const char* key, const char* value, bool isString);
@@ -0,0 +1,44 @@
+#ifndef OTAM_CAPTURE_H
+#define OTAM_CAPTURE_H
+
+#include "internal/OtamFeatures.h"
+
+#if OTAM_ENABLE_CAPTURE
+
+// Record types of the capture format, see tools/otam_replay.py
+enum OtamCaptureRecord : uint8_t {
+    OTAM_CAPTURE_REQUEST = 1,   // method, url and body of a request
+    OTAM_CAPTURE_RESPONSE = 2,  // status, content length and headers
+    OTAM_CAPTURE_BODY = 3,      // one read from the response body
+    OTAM_CAPTURE_END = 4,       // the exchange is complete
+};
+
+// Records HTTP exchanges with their timing to a Print sink in a compact
+// binary format. The stream starts with "OTAMCAP" and a version byte, every
+// record is type (1 byte), ms since begin (4 bytes), payload length (4 bytes)
+// and the payload, integers little-endian.
+class OtamCapture {
+   private:
+    static Print* sink;
+    static bool captureBodies;
+    static unsigned long startedAt;
+    static void writeUInt32(uint32_t value);
+    static void writeHeader(OtamCaptureRecord type, uint32_t length);
+    static void writeBody(const uint8_t* data, size_t size, bool withBytes);
+
+   public:
+    static void begin(Print* captureSink, bool bodies);
+    static void end();
+    static void request(const char* method, const String& url, const uint8_t* body, size_t size);
+    static void response(int httpCode, int contentLength, const String& headers);
+    static void body(const uint8_t* data, size_t size);
+    static void streamBody(const uint8_t* data, size_t size);
+    static void finish();
+};
+
+#define OTAM_CAPTURE(call) OtamCapture::call
+#else
+#define OTAM_CAPTURE(call) ((void)0)
+#endif
+
+#endif  // OTAM_CAPTURE_H
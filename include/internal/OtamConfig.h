@@ -8,6 +8,42 @@ struct OtamConfig {
     String url = "";       // base otam api url
     String deviceId = "";  // device id
     int deviceProfileId;   // device profile id
+
+    // Pre-flight stage: check heap and partition size and erase the OTA
+    // partition before the firmware download starts
+    bool preflightChecks = false;
+    int preflightMinFreeHeap = 32768;  // bytes of free heap required to start a download
+
+    // Firmware download bandwidth caps in bytes/s, 0 for unlimited
+    int downloadRateLimit = 0;          // used by doFirmwareUpdate
+    int stagedDownloadRateLimit = 0;    // used by stageUpdate, which runs in the background
+    bool adaptiveDownloadRate = false;  // back off while the application signals load
+
+    // Boot validation: a new image has to call confirmHealthy within this many
+    // ms of initialize or the previous partition is booted again, 0 disables it
+    unsigned long bootValidationTimeout = 0;
+    int bootValidationMaxBoots = 3;  // unconfirmed boots before reverting
+
+    // LAN peer distribution, call handlePeerRequests from the loop when serving
+    int peerPort = 0;            // serve the verified firmware image to neighbours, 0 disables
+    bool peerDiscovery = false;  // advertise and find peers over mDNS as well
+
+    // Mirror failover: a download that falls below this many bytes/s moves on to
+    // the next ranked mirror at the offset already written, 0 disables switching
+    int mirrorMinRate = 0;
+
+    // Seconds a resolved server address is reused, also across deep sleep. An
+    // expired address is still used while DNS is unreachable. 0 disables.
+    unsigned long dnsCacheTtl = 0;
+
+    // Offline spool: status and log reports that fail to send are kept in NVS
+    // and replayed in batches once the server is reachable again
+    int spoolCapacity = 0;                      // reports kept, oldest dropped first, 0 disables
+    int spoolReplayBatch = 4;                   // reports sent per replay
+    unsigned long spoolReplayInterval = 10000;  // ms between replays
+
+    // Offer CBOR to the server, payloads switch from JSON once it answers in kind
+    bool compactEncoding = false;
 };
 
 #endif  // OTAM_CONFIG_H
\ No newline at end of file
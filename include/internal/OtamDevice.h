@@ -11,6 +11,7 @@ class OtamDevice {
    private:
     void writeIdToStore(String id);
     void initialize(OtamConfig config);
+    void setUrls(OtamConfig config);
 
    public:
     String deviceGuid;
@@ -20,6 +21,7 @@ class OtamDevice {
     String deviceInitializeUrl;
     String deviceFirmwareFileUrl;
     explicit OtamDevice(OtamConfig config);
+    OtamDevice(OtamConfig config, String knownDeviceGuid);
 };
 
 #endif  // OTAM_DEVICE_H
\ No newline at end of file
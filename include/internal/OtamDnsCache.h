@@ -0,0 +1,40 @@
+#ifndef OTAM_DNS_CACHE_H
+#define OTAM_DNS_CACHE_H
+
+#include <WiFi.h>
+#include "internal/OtamFeatures.h"
+
+// Host names remembered, the least recently resolved entry is replaced first
+#ifndef OTAM_DNS_CACHE_SIZE
+#define OTAM_DNS_CACHE_SIZE 4
+#endif
+
+// Longest host name that is cached
+#ifndef OTAM_DNS_CACHE_HOST_LENGTH
+#define OTAM_DNS_CACHE_HOST_LENGTH 64
+#endif
+
+struct OtamDnsStats {
+    uint32_t hits = 0;       // answered from a fresh entry
+    uint32_t misses = 0;     // resolved through DNS
+    uint32_t staleHits = 0;  // DNS failed, answered from an expired entry
+    uint32_t failures = 0;   // DNS failed and nothing was cached
+};
+
+// Resolved addresses of the OTAM hosts, kept in RTC memory so they survive
+// deep sleep. Entries expire after the configured TTL, measured on the RTC
+// clock, and are still used when DNS is unreachable.
+class OtamDnsCache {
+   private:
+    static uint32_t ttl;
+    static int findEntry(const char* host);
+
+   public:
+    static void configure(uint32_t ttlSeconds);
+    static bool isEnabled();
+    static bool resolve(const String& host, IPAddress& address);
+    static void invalidate(const String& host);
+    static OtamDnsStats getStats();
+};
+
+#endif  // OTAM_DNS_CACHE_H
@@ -0,0 +1,96 @@
+#ifndef OTAM_FEATURES_H
+#define OTAM_FEATURES_H
+
+#include <Arduino.h>
+#include <functional>
+
+// Compile-time feature selection. Override with build flags, for example
+// -DOTAM_ENABLE_LOGGING=0, to remove a feature and its code entirely.
+
+// Serial diagnostics
+#ifndef OTAM_ENABLE_LOGGING
+#define OTAM_ENABLE_LOGGING 1
+#endif
+
+// onOta* application callbacks
+#ifndef OTAM_ENABLE_CALLBACKS
+#define OTAM_ENABLE_CALLBACKS 1
+#endif
+
+// Callbacks as std::function, 0 uses plain function pointers (captureless lambdas)
+#ifndef OTAM_ENABLE_STD_FUNCTION
+#define OTAM_ENABLE_STD_FUNCTION 1
+#endif
+
+// logDeviceMessage
+#ifndef OTAM_ENABLE_LOG_UPLOAD
+#define OTAM_ENABLE_LOG_UPLOAD 1
+#endif
+
+// Firmware name and version kept in NVS
+#ifndef OTAM_ENABLE_FIRMWARE_STRINGS
+#define OTAM_ENABLE_FIRMWARE_STRINGS 1
+#endif
+
+// LAN peer firmware server and mDNS discovery
+#ifndef OTAM_ENABLE_PEERS
+#define OTAM_ENABLE_PEERS 1
+#endif
+
+// Ranked download mirrors with probing and failover
+#ifndef OTAM_ENABLE_MIRRORS
+#define OTAM_ENABLE_MIRRORS 1
+#endif
+
+// Resolver cache for the OTAM hosts in RTC memory
+#ifndef OTAM_ENABLE_DNS_CACHE
+#define OTAM_ENABLE_DNS_CACHE 1
+#endif
+
+// Device vitals, sent as changes with the status poll and sync
+#ifndef OTAM_ENABLE_VITALS
+#define OTAM_ENABLE_VITALS 1
+#endif
+
+// Offline spool of undelivered status and log reports
+#ifndef OTAM_ENABLE_SPOOL
+#define OTAM_ENABLE_SPOOL 1
+#endif
+
+// Duration and heap trace records for API, http and NVS calls, off by default
+#ifndef OTAM_ENABLE_TRACING
+#define OTAM_ENABLE_TRACING 0
+#endif
+
+// Record HTTP exchanges and download timing for replay, off by default
+#ifndef OTAM_ENABLE_CAPTURE
+#define OTAM_ENABLE_CAPTURE 0
+#endif
+
+#if OTAM_ENABLE_LOGGING
+#define OTAM_LOG(message) Serial.println(message)
+#else
+#define OTAM_LOG(message) ((void)0)
+#endif
+
+#if OTAM_ENABLE_STD_FUNCTION
+template <typename... Args>
+using OtamCallback = std::function<void(Args...)>;
+#else
+template <typename... Args>
+using OtamCallback = void (*)(Args...);
+#endif
+
+// Call an application callback if one has been set
+#if OTAM_ENABLE_CALLBACKS
+#define OTAM_CALLBACK(callback, ...) \
+    do {                             \
+        if (callback) {              \
+            callback(__VA_ARGS__);   \
+        }                            \
+    } while (0)
+#else
+#define OTAM_CALLBACK(callback, ...) ((void)0)
+#endif
+
+#endif  // OTAM_FEATURES_H
@@ -2,17 +2,29 @@
 #define OTAM_HTTP_H
 
 #include <HTTPClient.h>
+#include "internal/OtamDnsCache.h"
+#include "internal/OtamPayload.h"
 
 struct OtamHttpResponse {
     int httpCode;
     String payload;
+    bool compact;  // payload is CBOR rather than JSON
 };
 
 class OtamHttp {
+   private:
+    static void addHeaders(HTTPClient& http);
+    static OtamHttpResponse readResponse(HTTPClient& http, int httpCode);
+
    public:
     static String apiKey;
+    static bool acceptCompactEncoding;
+    static bool begin(HTTPClient& http, WiFiClient& client, const String& url,
+                      int32_t connectTimeout = HTTPCLIENT_DEFAULT_TCP_TIMEOUT);
     static OtamHttpResponse get(String url);
     static OtamHttpResponse post(String url, String payload);
+    static OtamHttpResponse post(String url, OtamPayload& payload);
+    static OtamHttpResponse post(String url, const uint8_t* body, size_t size, const char* contentType);
 };
 
 #endif  // OTAM_HTTP_H
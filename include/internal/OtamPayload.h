@@ -0,0 +1,99 @@
+#ifndef OTAM_PAYLOAD_H
+#define OTAM_PAYLOAD_H
+
+#include <Arduino.h>
+#include "internal/LightCbor.h"
+#include "internal/LightJson.h"
+
+// Largest compact payload. Strings that do not fit are cut short, members that
+// do not fit at all are dropped, the document always stays well-formed.
+#ifndef OTAM_PAYLOAD_BUFFER_SIZE
+#define OTAM_PAYLOAD_BUFFER_SIZE 512
+#endif
+
+// Field table shared by the JSON and compact (CBOR) encodings. JSON uses the
+// names, CBOR uses the ids as map keys. Never renumber existing fields.
+enum OtamField : uint8_t {
+    OTAM_FIELD_DEVICE_ID = 1,
+    OTAM_FIELD_DEVICE_GUID = 2,
+    OTAM_FIELD_DEVICE_PROFILE_ID = 3,
+    OTAM_FIELD_DEVICE_STATUS = 4,
+    OTAM_FIELD_FIRMWARE_FILE_ID = 5,
+    OTAM_FIELD_FIRMWARE_ID = 6,
+    OTAM_FIELD_FIRMWARE_NAME = 7,
+    OTAM_FIELD_FIRMWARE_VERSION = 8,
+    OTAM_FIELD_LOG_MESSAGE = 9,
+    OTAM_FIELD_MESSAGE = 10,
+    OTAM_FIELD_FIRMWARE_FILE_URL = 11,
+    OTAM_FIELD_FIRMWARE_FILE_SIZE = 12,
+    OTAM_FIELD_FIRMWARE_FILE_HASH = 13,
+    OTAM_FIELD_FIRMWARE_FILE_URL_EXPIRES_IN = 14,
+    OTAM_FIELD_FIRMWARE_PEERS = 15,
+    OTAM_FIELD_DOWNLOAD_RATE = 16,
+    OTAM_FIELD_DOWNLOAD_RATE_LIMIT = 17,
+    OTAM_FIELD_SEQUENCE = 18,
+    OTAM_FIELD_FIRMWARE_MIRRORS = 19,
+    OTAM_FIELD_MIRROR_STATS = 20,
+    OTAM_FIELD_MIRROR_RANK = 21,
+    OTAM_FIELD_TIME_TO_FIRST_BYTE = 22,
+    OTAM_FIELD_DOWNLOAD_BYTES = 23,
+    OTAM_FIELD_LOGS = 24,
+    OTAM_FIELD_LOG_ACK = 25,
+    OTAM_FIELD_FREE_HEAP = 26,
+    OTAM_FIELD_UPTIME = 27,
+    OTAM_FIELD_RSSI = 28,
+    OTAM_FIELD_MIN_FREE_HEAP = 29,
+    OTAM_FIELD_RESET_REASON = 30,
+    OTAM_FIELD_RUNNING_FIRMWARE_FILE_ID = 31,
+    OTAM_FIELD_PARTITION = 32,
+};
+
+// Builds a request body in the negotiated encoding
+class OtamPayload {
+   private:
+    bool compact;
+    String json;
+    uint8_t buffer[OTAM_PAYLOAD_BUFFER_SIZE];
+    LightCborWriter cbor;
+    bool finished = false;
+    uint8_t depth = 0;         // open nested arrays and objects
+    uint8_t arrayMask = 0;     // bit n set when nesting level n is an array
+    uint8_t droppedDepth = 0;  // nesting levels opened after the compact buffer ran out
+    void keepComplete(size_t mark);
+    void addJsonSeparator();
+    void addJsonKey(OtamField field);
+    void addJsonString(const char* value);
+
+   public:
+    static bool compactEncoding;
+    static const char* fieldName(OtamField field);
+    OtamPayload();
+    void add(OtamField field, const char* value);
+    void add(OtamField field, const String& value);
+    void add(OtamField field, int value);
+    void beginArray(OtamField field);
+    void beginObject();
+    void addItem(const String& value);
+    void end();
+    bool isCompact() const;
+    const char* contentType() const;
+    size_t remaining() const;
+    const uint8_t* data();
+    size_t size();
+};
+
+// Reads fields of a response body in either encoding
+class OtamPayloadReader {
+   private:
+    const String& body;
+    bool compact;
+
+   public:
+    OtamPayloadReader(const String& body, bool compact);
+    String getValue(OtamField field);
+    int getIntValue(OtamField field);
+    bool hasKey(OtamField field);
+    String getArrayItem(OtamField field, int index);
+};
+
+#endif  // OTAM_PAYLOAD_H
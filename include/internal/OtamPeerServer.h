@@ -0,0 +1,26 @@
+#ifndef OTAM_PEER_SERVER_H
+#define OTAM_PEER_SERVER_H
+
+#include <ESPmDNS.h>
+#include <WebServer.h>
+#include <esp_ota_ops.h>
+#include "internal/OtamStore.h"
+
+class OtamPeerServer {
+   private:
+    WebServer* server = nullptr;
+    uint16_t serverPort = 0;
+    bool mdnsStarted = false;
+    void handleFirmwareRequest();
+
+   public:
+    static const char* firmwarePath;
+    ~OtamPeerServer();
+    bool begin(uint16_t port, bool advertise, String hostName);
+    void advertiseFirmware(int firmwareFileId);
+    void handle();
+    void stop();
+    static int discoverPeers(int firmwareFileId, String* peerUrls, int maxPeers);
+};
+
+#endif  // OTAM_PEER_SERVER_H
@@ -0,0 +1,42 @@
+#ifndef OTAM_SPOOL_H
+#define OTAM_SPOOL_H
+
+#include <Preferences.h>
+#include "internal/OtamFeatures.h"
+#include "internal/OtamHttp.h"
+#include "internal/OtamPayload.h"
+
+// Largest encoded report kept in the spool, bigger reports are only sent live
+#ifndef OTAM_SPOOL_MAX_ENTRY_SIZE
+#define OTAM_SPOOL_MAX_ENTRY_SIZE 1024
+#endif
+
+// Bounded ring of reports that could not be delivered, kept in its own NVS
+// namespace so it survives reboots. Every report carries a sequence number
+// the server can use to drop duplicates of replayed entries. Changing the
+// capacity drops the reports spooled under the previous one.
+class OtamSpool {
+   private:
+    int capacity = 0;
+    int replayBatch = 4;
+    unsigned long replayInterval = 0;
+    unsigned long lastReplayAt = 0;
+    bool replayed = false;
+    bool linkDown = false;       // the last send failed, reports go straight to the spool
+    uint32_t sequence = 0;       // sequence number of the next report
+    uint32_t sequenceLimit = 0;  // first sequence number not yet reserved in NVS
+    uint32_t head = 0;           // ring index of the oldest spooled report
+    uint32_t tail = 0;           // ring index of the next spooled report
+    String entryKey(uint32_t index);
+    bool nextSequence(uint32_t& number);
+    void append(const String& url, OtamPayload& payload);
+
+   public:
+    void begin(int capacity, int replayBatch, unsigned long replayInterval);
+    bool isEnabled();
+    OtamHttpResponse post(String url, OtamPayload& payload);
+    int replay();
+    int size();
+};
+
+#endif  // OTAM_SPOOL_H
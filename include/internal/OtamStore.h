@@ -2,6 +2,7 @@
 #define OTAM_STORE_H
 
 #include <Preferences.h>
+#include "internal/OtamFeatures.h"
 
 class OtamStore {
    public:
@@ -11,12 +12,34 @@ class OtamStore {
     static void writeFirmwareUpdateFileIdToStore(int firmwareUpdateFileId);
     static int readFirmwareUpdateIdFromStore();
     static void writeFirmwareUpdateIdToStore(int firmwareUpdateId);
+#if OTAM_ENABLE_FIRMWARE_STRINGS
     static String readFirmwareUpdateNameFromStore();
     static void writeFirmwareUpdateNameToStore(String firmwareUpdateName);
     static String readFirmwareUpdateVersionFromStore();
+    static void writeFirmwareUpdateVersionToStore(String firmwareUpdateVersion);
+#endif
     static void writeFirmwareUpdateStatusToStore(String firmwareUpdateStatus);
     static String readFirmwareUpdateStatusFromStore();
-    static void writeFirmwareUpdateVersionToStore(String firmwareUpdateVersion);
+    static String readStagedPartitionFromStore();
+    static void writeStagedPartitionToStore(String stagedPartition);
+    static String readPreviousPartitionFromStore();
+    static void writePreviousPartitionToStore(String previousPartition);
+    static int readVerifyBootCountFromStore();
+    static void writeVerifyBootCountToStore(int verifyBootCount);
+    static String readRollbackReasonFromStore();
+    static void writeRollbackReasonToStore(String rollbackReason);
+    static int readPeerFileIdFromStore();
+    static void writePeerFileIdToStore(int peerFileId);
+    static String readPeerPartitionFromStore();
+    static void writePeerPartitionToStore(String peerPartition);
+    static int readPeerFileSizeFromStore();
+    static void writePeerFileSizeToStore(int peerFileSize);
+    static String readPeerFileHashFromStore();
+    static void writePeerFileHashToStore(String peerFileHash);
+    static int readRunningFileIdFromStore();
+    static void writeRunningFileIdToStore(int runningFileId);
+    static bool readUpdateStatsFromStore(void* updateStats, size_t size);
+    static void writeUpdateStatsToStore(const void* updateStats, size_t size);
 };
 
 #endif  // OTAM_STORE_H
\ No newline at end of file
@@ -0,0 +1,37 @@
+#ifndef OTAM_THROTTLE_H
+#define OTAM_THROTTLE_H
+
+#include <Arduino.h>
+
+struct OtamDownloadStats {
+    uint32_t bytes = 0;             // bytes passed through the throttle
+    uint32_t durationMs = 0;        // time from the start to the last byte
+    uint32_t achievedRate = 0;      // average bytes/s over the transfer
+    uint32_t rateLimit = 0;         // configured bytes/s cap, 0 if unlimited
+    uint32_t minEffectiveRate = 0;  // lowest bytes/s the adaptive mode backed off to
+};
+
+class OtamThrottle {
+   private:
+    uint32_t rateLimit = 0;
+    uint32_t effectiveRate = 0;
+    bool adaptive = false;
+    volatile bool applicationBusy = false;
+    uint32_t tokens = 0;
+    unsigned long lastRefillAt = 0;
+    unsigned long lastAdaptAt = 0;
+    OtamDownloadStats stats;
+    unsigned long startedAt = 0;
+    void refill();
+    void adapt();
+
+   public:
+    void configure(uint32_t bytesPerSecond, bool adaptiveRate);
+    void setApplicationBusy(bool busy);
+    void start();
+    size_t acquire(size_t wanted);
+    OtamDownloadStats getStats();
+    uint32_t getEffectiveRate();
+};
+
+#endif  // OTAM_THROTTLE_H
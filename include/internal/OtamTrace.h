@@ -0,0 +1,53 @@
+#ifndef OTAM_TRACE_H
+#define OTAM_TRACE_H
+
+#include "internal/OtamFeatures.h"
+
+#if OTAM_ENABLE_TRACING
+
+// Records kept for OtamTrace::read when no sink is set
+#ifndef OTAM_TRACE_BUFFER_SIZE
+#define OTAM_TRACE_BUFFER_SIZE 32
+#endif
+
+// One traced call, heap figures are in bytes
+struct OtamTraceRecord {
+    const char* name;         // traced function
+    uint32_t startedAt;       // micros() when the call started
+    uint32_t duration;        // call duration in us
+    uint32_t freeHeapBefore;  // free heap when the call started
+    uint32_t freeHeapAfter;   // free heap when the call returned
+    uint32_t minFreeHeap;     // lowest free heap since boot
+    uint32_t maxAllocHeap;    // largest free block when the call returned
+};
+
+// Collects trace records in a ring buffer or hands them to a sink
+class OtamTrace {
+   private:
+    static OtamCallback<const OtamTraceRecord&> sink;
+    static OtamTraceRecord records[OTAM_TRACE_BUFFER_SIZE];
+    static int head;
+    static int count;
+
+   public:
+    static void setSink(OtamCallback<const OtamTraceRecord&> traceSink);
+    static void record(const OtamTraceRecord& traceRecord);
+    static int read(OtamTraceRecord* buffer, int maxRecords);
+};
+
+// Traces the enclosing scope from construction to destruction
+class OtamTraceScope {
+   private:
+    OtamTraceRecord traceRecord;
+
+   public:
+    explicit OtamTraceScope(const char* name);
+    ~OtamTraceScope();
+};
+
+#define OTAM_TRACE(name) OtamTraceScope otamTraceScope(name)
+#else
+#define OTAM_TRACE(name) ((void)0)
+#endif
+
+#endif  // OTAM_TRACE_H
@@ -2,28 +2,50 @@
 #define OTAM_UPDATER_H
 
 #include <HTTPClient.h>
-#include <Update.h>
-#include <functional>
+#include <MD5Builder.h>
+#include <esp_ota_ops.h>
+#include "internal/OtamFeatures.h"
+#include "internal/OtamThrottle.h"
 
-class OtamUpdater {
-   public:
-    // Define the type for the callback functions
-    using CallbackType = std::function<void()>;
-    using NumberCallbackType = std::function<void(int)>;
-    using StringCallbackType = std::function<void(String)>;
+// Outcome of writing one response body to flash
+enum OtamStreamResult {
+    OTAM_STREAM_COMPLETE,     // the whole image has been written
+    OTAM_STREAM_SLOW,         // the source fell below the minimum rate, resumable
+    OTAM_STREAM_INTERRUPTED,  // the source stopped sending, resumable
+    OTAM_STREAM_FAILED,       // flash write failed, the download was aborted
+};
 
-    // Variables to hold the callback functions
-    CallbackType otaAfterDownloadCallback;
-    NumberCallbackType otaDownloadProgressCallback;
-    CallbackType otaSuccessCallback;
-    StringCallbackType otaErrorCallback;
+class OtamUpdater {
+   private:
+    const esp_partition_t* updatePartition = nullptr;
+    esp_ota_handle_t otaHandle = 0;
+    bool otaStarted = false;
+    size_t preparedSize = 0;
+    size_t imageSize = 0;
+    size_t writtenSize = 0;
+    MD5Builder md5;
+    OtamThrottle* throttle = nullptr;
+#if OTAM_ENABLE_CALLBACKS
+    const OtamCallback<int>* otaDownloadProgressCallback = nullptr;
+#endif
+    bool beginOta(size_t expectedSize, bool eraseUpFront, String& error);
+    void abortOta();
+    String otaErrorMessage(esp_err_t err);
 
-    // Define the callback functions
-    void onOtaAfterDownload(CallbackType afterDownloadCallback);
-    void onOtaDownloadProgress(NumberCallbackType progressCallback);
-    void onOtaSuccess(CallbackType successCallback);
-    void onOtaError(StringCallbackType errorCallback);
-    void runESP32Update(HTTPClient& http);
+   public:
+    ~OtamUpdater();
+#if OTAM_ENABLE_CALLBACKS
+    void onOtaDownloadProgress(const OtamCallback<int>* progressCallback);
+#endif
+    void setThrottle(OtamThrottle* downloadThrottle);
+    String getUpdatePartitionLabel();
+    size_t getWrittenSize();
+    bool preflight(int imageSize, int minFreeHeap, String& error);
+    bool beginDownload(size_t totalSize, String& error);
+    OtamStreamResult writeStream(HTTPClient& http, uint32_t minRate, String& error);
+    bool finishDownload(String expectedMd5, String& error);
+    bool runESP32Update(HTTPClient& http, String expectedMd5, String& error);
+    bool activate(String& error);
 };
 
-#endif  // OTAM_UPDATER_H
\ No newline at end of file
+#endif  // OTAM_UPDATER_H
@@ -0,0 +1,50 @@
+#ifndef OTAM_VITALS_H
+#define OTAM_VITALS_H
+
+#include "internal/OtamFeatures.h"
+#include "internal/OtamPayload.h"
+
+// Change in bytes before the free and minimum heap are reported again
+#ifndef OTAM_VITALS_HEAP_THRESHOLD
+#define OTAM_VITALS_HEAP_THRESHOLD 2048
+#endif
+
+// Change in dBm before the RSSI is reported again
+#ifndef OTAM_VITALS_RSSI_THRESHOLD
+#define OTAM_VITALS_RSSI_THRESHOLD 6
+#endif
+
+// Seconds of uptime before it is reported again, a reboot is always reported
+#ifndef OTAM_VITALS_UPTIME_THRESHOLD
+#define OTAM_VITALS_UPTIME_THRESHOLD 3600
+#endif
+
+// Reported vitals, the order is the bit order of the change masks
+enum OtamVital {
+    OTAM_VITAL_FREE_HEAP,
+    OTAM_VITAL_MIN_FREE_HEAP,
+    OTAM_VITAL_RSSI,
+    OTAM_VITAL_UPTIME,
+    OTAM_VITAL_RESET_REASON,
+    OTAM_VITAL_FIRMWARE_FILE_ID,
+    OTAM_VITAL_PARTITION,
+    OTAM_VITAL_COUNT,
+};
+
+// Device health attached to the status poll. Only vitals that moved beyond
+// their threshold since the last report the server acknowledged are sent, the
+// acknowledged values are kept in RTC memory so deep sleep does not reset them.
+class OtamVitals {
+   private:
+    int32_t pendingValues[OTAM_VITAL_COUNT];
+    String pendingPartition;
+    uint32_t pendingMask = 0;
+    void collect();
+
+   public:
+    void addTo(OtamPayload& payload);
+    String toQueryString();
+    void acknowledge();
+};
+
+#endif  // OTAM_VITALS_H
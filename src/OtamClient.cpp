@@ -1,5 +1,11 @@
 #include "OtamClient.h"
 
+#if OTAM_ENABLE_MIRRORS
+// Mirrors that take longer than this to connect and answer are ranked last
+const uint16_t MIRROR_PROBE_TIMEOUT_MS = 3000;
+#endif
+
+#if OTAM_ENABLE_CALLBACKS
 // Subscribe to the OTA download progress callback
 void OtamClient::onOtaDownloadProgress(NumberCallbackType progressCallback) {
     otaDownloadProgressCallback = progressCallback;
@@ -29,19 +35,79 @@ void OtamClient::onOtaSuccess(SuccessCallbackType successCallback) {
 void OtamClient::onOtaError(ErrorCallbackType errorCallback) {
     otaErrorCallback = errorCallback;
 }
+#endif
 
 void OtamClient::sendOtaUpdateError(String logMessage) {
-    Serial.println("Sending OTA update error: " + logMessage);
-    OtamHttp::post(otamDevice->deviceStatusUrl,
-                   "{\"deviceStatus\":\"UPDATE_FAILED\",\"firmwareFileId\":" +
-                       String(firmwareUpdateValues.firmwareFileId) + ",\"firmwareId\":" +
-                       String(firmwareUpdateValues.firmwareId) + ",\"firmwareVersion\":\"" +
-                       firmwareUpdateValues.firmwareVersion + "\",\"logMessage\":\"" + logMessage + "\"}");
+    OTAM_LOG("Sending OTA update error: " + logMessage);
+    OtamPayload payload;
+    payload.add(OTAM_FIELD_DEVICE_STATUS, "UPDATE_FAILED");
+    payload.add(OTAM_FIELD_FIRMWARE_FILE_ID, firmwareUpdateValues.firmwareFileId);
+    payload.add(OTAM_FIELD_FIRMWARE_ID, firmwareUpdateValues.firmwareId);
+#if OTAM_ENABLE_FIRMWARE_STRINGS
+    payload.add(OTAM_FIELD_FIRMWARE_VERSION, firmwareUpdateValues.firmwareVersion);
+#endif
+    payload.add(OTAM_FIELD_LOG_MESSAGE, logMessage);
+    postReport(otamDevice->deviceStatusUrl, payload);
+}
+
+// Send a status or log report, spooling it while the server is unreachable
+OtamHttpResponse OtamClient::postReport(String url, OtamPayload& payload) {
+#if OTAM_ENABLE_SPOOL
+    return reportSpool.post(url, payload);
+#else
+    return OtamHttp::post(url, payload);
+#endif
+}
+
+// Abort the running firmware update and report the error
+void OtamClient::failFirmwareUpdate(String error) {
+    updateStarted = false;
+    OTAM_CALLBACK(otaErrorCallback, firmwareUpdateValues, error);
+    sendOtaUpdateError(error);
+}
+
+// Check if the prefetched firmware file url has expired
+bool OtamClient::firmwareFileUrlExpired() {
+    if (firmwareUpdateValues.firmwareFileUrlExpiresAt == 0) {
+        return false;
+    }
+    return (long)(millis() - firmwareUpdateValues.firmwareFileUrlExpiresAt) >= 0;
+}
+
+// Prefix server relative firmware file paths with the OTAM api url
+String OtamClient::toAbsoluteUrl(String url) {
+    if (url.startsWith("http")) {
+        return url;
+    }
+    return clientOtamConfig.url + url;
+}
+
+// Request the firmware file url from the server, returns an empty string on failure
+String OtamClient::requestFirmwareFileUrl(String& error) {
+    // OTAM_LOG("Getting device firmware file url from: " + otamDevice->deviceFirmwareFileUrl);
+
+    OtamHttpResponse response = OtamHttp::get(otamDevice->deviceFirmwareFileUrl);
+
+    if (response.httpCode != 200 || response.payload == "") {
+        error = "Firmware file url request failed, error: " + String(response.httpCode);
+        return "";
+    }
+
+    // The JSON api returns the bare url
+    if (response.compact) {
+        OtamPayloadReader reply(response.payload, true);
+        return toAbsoluteUrl(reply.getValue(OTAM_FIELD_FIRMWARE_FILE_URL));
+    }
+    return toAbsoluteUrl(response.payload);
 }
 
 OtamClient::OtamClient(const OtamConfig& config) {
     clientOtamConfig = config;
     OtamHttp::apiKey = config.apiKey;
+    OtamHttp::acceptCompactEncoding = config.compactEncoding;
+#if OTAM_ENABLE_DNS_CACHE
+    OtamDnsCache::configure(config.dnsCacheTtl);
+#endif
 }
 
 // Check if the device has been initialized
@@ -51,226 +117,1114 @@ bool OtamClient::isInitialized() {
 
 // Initialize the OTAM client
 void OtamClient::initialize() {
+    OTAM_TRACE("OtamClient::initialize");
     if (!deviceInitialized) {
-        // Serial.println("Initializing OTAM client");
+        // OTAM_LOG("Initializing OTAM client");
 
         // Create the device
         otamDevice = new OtamDevice(clientOtamConfig);
         deviceInitialized = true;
 
-        // If firmware update status success, publish to success callback
-        String firmwareUpdateStatus = OtamStore::readFirmwareUpdateStatusFromStore();
-        // Serial.println("OtamClient Contrcutor: Store -> Firmware update status: " + firmwareUpdateStatus);
-        if (firmwareUpdateStatus == "UPDATE_SUCCESS") {
-            // Serial.println(
-            //     "Firmware update status is UPDATE_SUCCESS, calling OTA success "
-            //     "callback");
-            FirmwareUpdateValues firmwareUpdateSuccessValues;
-            firmwareUpdateSuccessValues.firmwareFileId = OtamStore::readFirmwareUpdateFileIdFromStore();
-            firmwareUpdateSuccessValues.firmwareId = OtamStore::readFirmwareUpdateIdFromStore();
-            firmwareUpdateSuccessValues.firmwareName = OtamStore::readFirmwareUpdateNameFromStore();
-            firmwareUpdateSuccessValues.firmwareVersion = OtamStore::readFirmwareUpdateVersionFromStore();
-
-            // Clear the firmware update status
-            OtamStore::writeFirmwareUpdateStatusToStore("NONE");
-
-            // Check if the callback has been set
-            if (otaSuccessCallback) {
-                // Call the callback with parameters
-                otaSuccessCallback(firmwareUpdateSuccessValues);
-            }
-        }
+        startDevice();
+    }
+}
+
+// Start the services of an initialized device and finish a firmware update
+// that was interrupted by the reboot
+void OtamClient::startDevice() {
+#if OTAM_ENABLE_PEERS
+    // Offer the verified firmware image to LAN peers
+    if (clientOtamConfig.peerPort > 0) {
+        peerServer.begin(clientOtamConfig.peerPort, clientOtamConfig.peerDiscovery,
+                         "otam-" + clientOtamConfig.deviceId);
+    }
+#endif
+
+#if OTAM_ENABLE_SPOOL
+    // Reports left over from the last time the server was unreachable
+    reportSpool.begin(clientOtamConfig.spoolCapacity, clientOtamConfig.spoolReplayBatch,
+                      clientOtamConfig.spoolReplayInterval);
+#endif
+
+    // If firmware update status success, publish to success callback
+    String firmwareUpdateStatus = OtamStore::readFirmwareUpdateStatusFromStore();
+    // OTAM_LOG("OtamClient Contrcutor: Store -> Firmware update status: " + firmwareUpdateStatus);
+    if (firmwareUpdateStatus == "UPDATE_SUCCESS") {
+        // OTAM_LOG(
+        //     "Firmware update status is UPDATE_SUCCESS, calling OTA success "
+        //     "callback");
+        FirmwareUpdateValues firmwareUpdateSuccessValues = readStoredFirmwareUpdateValues();
+
+        // Clear the firmware update status
+        OtamStore::writeFirmwareUpdateStatusToStore("NONE");
+        OtamStore::writeRunningFileIdToStore(firmwareUpdateSuccessValues.firmwareFileId);
+
+        // Call the callback with parameters if it has been set
+        OTAM_CALLBACK(otaSuccessCallback, firmwareUpdateSuccessValues);
+    } else if (firmwareUpdateStatus == "UPDATE_VERIFYING") {
+        // First boots of a new image, it has to confirm it is healthy
+        beginBootValidation();
+    } else if (firmwareUpdateStatus == "UPDATE_ROLLED_BACK") {
+        // Back on the previous image, tell the server why
+        reportFirmwareRollback();
+    }
+}
+
+// Start the health check deadline of a newly booted image
+void OtamClient::beginBootValidation() {
+    String previousPartition = OtamStore::readPreviousPartitionFromStore();
+    const esp_partition_t* runningPartition = esp_ota_get_running_partition();
+
+    // The bootloader already went back to the previous image
+    if (previousPartition == runningPartition->label) {
+        OtamStore::writeRollbackReasonToStore("Bootloader reverted to the previous firmware");
+        reportFirmwareRollback();
+        return;
+    }
+
+    pendingVerification = true;
+
+    // The new image does not use boot validation, accept it right away
+    if (clientOtamConfig.bootValidationTimeout == 0) {
+        confirmHealthy();
+        return;
+    }
+
+    // Count the boots of the unconfirmed image to catch boot loops
+    int bootCount = OtamStore::readVerifyBootCountFromStore() + 1;
+    OtamStore::writeVerifyBootCountToStore(bootCount);
+    if (bootCount > clientOtamConfig.bootValidationMaxBoots) {
+        revertFirmwareUpdate("Firmware not confirmed healthy within " + String(bootCount - 1) + " boots");
+        return;
     }
+
+    OTAM_LOG("OTAM: New firmware pending verification, waiting for confirmHealthy");
+
+    esp_timer_create_args_t timerArgs = {};
+    timerArgs.callback = &OtamClient::onBootValidationTimeout;
+    timerArgs.arg = this;
+    timerArgs.name = "otam_verify";
+    if (esp_timer_create(&timerArgs, &bootValidationTimer) == ESP_OK) {
+        esp_timer_start_once(bootValidationTimer, (uint64_t)clientOtamConfig.bootValidationTimeout * 1000);
+    }
+}
+
+// Runs on the esp_timer task when the health check deadline passes. The revert
+// runs in its own task so it happens even when the app never calls the client
+// again, the esp_timer stack is too small for NVS writes.
+void OtamClient::onBootValidationTimeout(void* arg) {
+    OtamClient* client = static_cast<OtamClient*>(arg);
+    if (!client->takePendingVerification()) {
+        return;
+    }
+
+    if (xTaskCreate(&OtamClient::bootValidationRevertTask, "otam_revert", OTAM_REVERT_TASK_STACK_SIZE, client,
+                    OTAM_REVERT_TASK_PRIORITY, nullptr) != pdPASS) {
+        // Left to the next client call on the app task
+        client->verificationExpired = true;
+    }
+}
+
+// Revert and restart, only returns when there is no previous image to go back to
+void OtamClient::bootValidationRevertTask(void* arg) {
+    OtamClient* client = static_cast<OtamClient*>(arg);
+    client->revertFirmwareUpdate("Health check deadline of " +
+                                 String(client->clientOtamConfig.bootValidationTimeout) + " ms exceeded");
+    vTaskDelete(nullptr);
+}
+
+// Clear the pending verification, returns whether it was set. Only one of
+// confirmHealthy and the health check deadline can win.
+bool OtamClient::takePendingVerification() {
+    portENTER_CRITICAL(&verificationMux);
+    bool wasPending = pendingVerification;
+    pendingVerification = false;
+    portEXIT_CRITICAL(&verificationMux);
+    return wasPending;
+}
+
+// Revert the firmware update when the health check deadline has passed and
+// the revert task could not be started
+void OtamClient::handleVerificationTimeout() {
+    if (!verificationExpired) {
+        return;
+    }
+    verificationExpired = false;
+
+    revertFirmwareUpdate("Health check deadline of " + String(clientOtamConfig.bootValidationTimeout) +
+                         " ms exceeded");
+}
+
+// Check if the image about to be offered is the one still waiting for confirmHealthy,
+// downloading it again would overwrite the partition a revert goes back to
+bool OtamClient::isUpdateBeingVerified() {
+    if (pendingVerification || verificationExpired) {
+        return true;
+    }
+
+    return OtamStore::readFirmwareUpdateStatusFromStore() == "UPDATE_VERIFYING" &&
+           OtamStore::readFirmwareUpdateFileIdFromStore() == firmwareUpdateValues.firmwareFileId;
+}
+
+// Boot back into the previous image and remember why
+void OtamClient::revertFirmwareUpdate(String reason) {
+    OTAM_LOG("OTAM: Reverting firmware update: " + reason);
+    pendingVerification = false;
+
+    String previousPartition = OtamStore::readPreviousPartitionFromStore();
+    const esp_partition_t* partition = esp_partition_find_first(
+        ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_ANY, previousPartition.c_str());
+    if (!partition || esp_ota_set_boot_partition(partition) != ESP_OK) {
+        // Nothing to go back to, keep running rather than reboot into the same image
+        OTAM_LOG("OTAM: Previous partition " + previousPartition + " is not bootable, keeping firmware");
+        OtamStore::writeFirmwareUpdateStatusToStore("NONE");
+        return;
+    }
+
+    OtamStore::writeRollbackReasonToStore(reason);
+    OtamStore::writeFirmwareUpdateStatusToStore("UPDATE_ROLLED_BACK");
+
+#if OTAM_ENABLE_PEERS
+    // A reverted image must not be handed to LAN peers
+    OtamStore::writePeerFileIdToStore(0);
+#endif
+
+    // With bootloader rollback enabled, let it mark this image invalid as well
+    esp_ota_img_states_t otaState;
+    if (esp_ota_get_state_partition(esp_ota_get_running_partition(), &otaState) == ESP_OK &&
+        otaState == ESP_OTA_IMG_PENDING_VERIFY) {
+        esp_ota_mark_app_invalid_rollback_and_reboot();
+    }
+
+    ESP.restart();
+}
+
+// Report a reverted firmware update to the server and the error callback
+void OtamClient::reportFirmwareRollback() {
+    firmwareUpdateValues = readStoredFirmwareUpdateValues();
+    String error = "Firmware update rolled back: " + OtamStore::readRollbackReasonFromStore();
+    OTAM_LOG("OTAM: " + error);
+
+    // Clear the firmware update status
+    OtamStore::writeFirmwareUpdateStatusToStore("NONE");
+    OtamStore::writePreviousPartitionToStore("");
+
+    OTAM_CALLBACK(otaErrorCallback, firmwareUpdateValues, error);
+    sendOtaUpdateError(error);
+}
+
+// Confirm the newly booted image works, cancelling the automatic revert
+bool OtamClient::confirmHealthy() {
+    OTAM_TRACE("OtamClient::confirmHealthy");
+    handleVerificationTimeout();
+
+    if (!takePendingVerification()) {
+        return false;
+    }
+
+    if (bootValidationTimer) {
+        esp_timer_stop(bootValidationTimer);
+        esp_timer_delete(bootValidationTimer);
+        bootValidationTimer = nullptr;
+    }
+
+    // Only succeeds when bootloader rollback is enabled
+    esp_ota_mark_app_valid_cancel_rollback();
+
+    // The server hears about the update once the image is known to work, with
+    // the download figures the previous image stored before the reboot
+    firmwareUpdateValues = readStoredFirmwareUpdateValues();
+    UpdateStats stats;
+    if (!OtamStore::readUpdateStatsFromStore(&stats, sizeof(stats))) {
+        stats = UpdateStats();
+    }
+    postFirmwareUpdateSuccess(stats);
+
+    // Clear the firmware update status
+    OtamStore::writeFirmwareUpdateStatusToStore("NONE");
+    OtamStore::writePreviousPartitionToStore("");
+    OtamStore::writeRunningFileIdToStore(firmwareUpdateValues.firmwareFileId);
+
+    OTAM_CALLBACK(otaSuccessCallback, firmwareUpdateValues);
+
+    return true;
+}
+
+// Check if the running image still has to call confirmHealthy
+bool OtamClient::isPendingVerification() {
+    handleVerificationTimeout();
+    return pendingVerification;
+}
+
+#if OTAM_ENABLE_LOG_UPLOAD
+// Keep a log message for the next sync, the oldest message is dropped when the queue is full
+void OtamClient::queueDeviceMessage(String message) {
+    if (queuedLogCount == maxQueuedLogs) {
+        dropQueuedLogs(1);
+    }
+    queuedLogs[queuedLogCount++] = message;
+}
+
+// Remove the oldest count messages from the log queue
+void OtamClient::dropQueuedLogs(int count) {
+    count = min(count, queuedLogCount);
+    for (int i = count; i < queuedLogCount; i++) {
+        queuedLogs[i - count] = queuedLogs[i];
+    }
+    for (int i = queuedLogCount - count; i < queuedLogCount; i++) {
+        queuedLogs[i] = "";
+    }
+    queuedLogCount -= count;
 }
 
 // Log a message to the device log api
 OtamHttpResponse OtamClient::logDeviceMessage(String message) {
+    OTAM_TRACE("OtamClient::logDeviceMessage");
     // Send the log entry
-    OtamHttpResponse response = OtamHttp::post(otamDevice->deviceLogUrl, "{\"message\":\"" + message + "\"}");
+    OtamPayload payload;
+    payload.add(OTAM_FIELD_MESSAGE, message);
+    OtamHttpResponse response = postReport(otamDevice->deviceLogUrl, payload);
 
     // Return the response
     return response;
 }
+#endif
+
+// Take over the firmware update details of an UPDATE_PENDING status reply,
+// returns true when the update still has to be downloaded
+bool OtamClient::applyDeviceStatus(OtamPayloadReader& status) {
+    // Get the device status from the response
+    String deviceStatus = status.getValue(OTAM_FIELD_DEVICE_STATUS);
+
+    // Check if the device status is UPDATE_PENDING
+    if (deviceStatus.equals("UPDATE_PENDING")) {
+        firmwareUpdateValues.firmwareFileId = status.getIntValue(OTAM_FIELD_FIRMWARE_FILE_ID);
+        firmwareUpdateValues.firmwareId = status.getIntValue(OTAM_FIELD_FIRMWARE_ID);
+#if OTAM_ENABLE_FIRMWARE_STRINGS
+        firmwareUpdateValues.firmwareName = status.getValue(OTAM_FIELD_FIRMWARE_NAME);
+        firmwareUpdateValues.firmwareVersion = status.getValue(OTAM_FIELD_FIRMWARE_VERSION);
+#endif
+
+        // Cache the download details if the server sent them along with the status
+        firmwareUpdateValues.firmwareFileUrl = status.getValue(OTAM_FIELD_FIRMWARE_FILE_URL);
+        firmwareUpdateValues.firmwareFileSize = status.getIntValue(OTAM_FIELD_FIRMWARE_FILE_SIZE);
+        firmwareUpdateValues.firmwareFileHash = status.getValue(OTAM_FIELD_FIRMWARE_FILE_HASH);
+
+#if OTAM_ENABLE_MIRRORS
+        // Download mirrors in the order the server ranks them
+        firmwareMirrorCount = 0;
+        while (firmwareMirrorCount < maxFirmwareMirrors) {
+            String mirrorUrl = status.getArrayItem(OTAM_FIELD_FIRMWARE_MIRRORS, firmwareMirrorCount);
+            if (mirrorUrl == "") {
+                break;
+            }
+            firmwareMirrors[firmwareMirrorCount++] = mirrorUrl;
+        }
+#endif
+
+#if OTAM_ENABLE_PEERS
+        // LAN peers that already hold the verified image
+        firmwarePeerCount = 0;
+        while (firmwarePeerCount < maxFirmwarePeers) {
+            String peerUrl = status.getArrayItem(OTAM_FIELD_FIRMWARE_PEERS, firmwarePeerCount);
+            if (peerUrl == "") {
+                break;
+            }
+            firmwarePeers[firmwarePeerCount++] = peerUrl;
+        }
+#endif
+
+        // The url expiry is sent in seconds relative to now, the device has no wall clock
+        int expiresIn = status.getIntValue(OTAM_FIELD_FIRMWARE_FILE_URL_EXPIRES_IN);
+        firmwareUpdateValues.firmwareFileUrlExpiresAt =
+            expiresIn > 0 ? millis() + (unsigned long)expiresIn * 1000UL : 0;
+
+        // The update is installed and only waiting for confirmHealthy
+        if (isUpdateBeingVerified()) {
+            return false;
+        }
+
+        // The update is already staged and only waiting for activateUpdate
+        if (hasStagedUpdate() &&
+            OtamStore::readFirmwareUpdateFileIdFromStore() == firmwareUpdateValues.firmwareFileId) {
+            return false;
+        }
+
+        return true;
+    }
+
+    return false;
+}
+
+// Initialize the device if needed, upload the queued log messages and vitals and
+// check for a firmware update in one request. Returns true like hasPendingUpdate.
+boolean OtamClient::sync() {
+    OTAM_TRACE("OtamClient::sync");
+    handleVerificationTimeout();
+
+    if (updateStarted) {
+        return false;
+    }
+
+    if (syncUnsupported) {
+        return syncSeparately();
+    }
+
+    // The server initializes an unknown device as part of the sync
+    String deviceGuid = deviceInitialized ? otamDevice->deviceGuid : OtamStore::readDeviceGuidFromStore();
+
+    OtamPayload payload;
+    payload.add(OTAM_FIELD_DEVICE_ID, clientOtamConfig.deviceId);
+    payload.add(OTAM_FIELD_DEVICE_GUID, deviceGuid);
+    payload.add(OTAM_FIELD_DEVICE_PROFILE_ID, clientOtamConfig.deviceProfileId);
+
+#if OTAM_ENABLE_VITALS
+    // Only the vitals that changed since the last acknowledged report, ahead of
+    // the log messages so they always fit
+    deviceVitals.addTo(payload);
+#endif
+
+#if OTAM_ENABLE_LOG_UPLOAD
+    // Send as many queued messages as fit, the rest waits for the next sync
+    int sentLogCount = 0;
+    if (queuedLogCount > 0) {
+        payload.beginArray(OTAM_FIELD_LOGS);
+        while (sentLogCount < queuedLogCount) {
+            // Text head of up to 3 bytes, the first message is cut short rather than held back
+            size_t itemSize = queuedLogs[sentLogCount].length() + 3;
+            if (sentLogCount > 0 && payload.remaining() < itemSize) {
+                break;
+            }
+            payload.addItem(queuedLogs[sentLogCount]);
+            sentLogCount++;
+        }
+        payload.end();
+    }
+#endif
+
+    OtamHttpResponse response = OtamHttp::post(clientOtamConfig.url + "/sync", payload);
+
+    // Older servers only know the separate endpoints
+    if (response.httpCode == 404) {
+        OTAM_LOG("OTAM: Server has no sync endpoint, using separate requests");
+        syncUnsupported = true;
+        return syncSeparately();
+    }
+
+    if (response.httpCode != 200) {
+        OTAM_LOG("OTAM: Sync failed, error: " + String(response.httpCode));
+#if OTAM_ENABLE_LOG_UPLOAD
+        // The server rejected the request, sending the same batch again would fail
+        // the same way and block every later message
+        if (response.httpCode >= 400 && response.httpCode < 500 && sentLogCount > 0) {
+            OTAM_LOG("OTAM: Dropping " + String(sentLogCount) + " rejected log messages");
+            dropQueuedLogs(sentLogCount);
+        }
+#endif
+        return false;
+    }
+
+#if OTAM_ENABLE_VITALS
+    deviceVitals.acknowledge();
+#endif
+
+    OtamPayloadReader reply(response.payload, response.compact);
+
+    if (!deviceInitialized) {
+        String syncedGuid = reply.getValue(OTAM_FIELD_DEVICE_GUID);
+        if (syncedGuid != "" && syncedGuid != deviceGuid) {
+            OtamStore::writeDeviceGuidToStore(syncedGuid);
+            deviceGuid = syncedGuid;
+        }
+
+        if (deviceGuid == "") {
+            OTAM_LOG("OTAM: Sync returned no device GUID");
+            return false;
+        }
+
+        otamDevice = new OtamDevice(clientOtamConfig, deviceGuid);
+        deviceInitialized = true;
+        startDevice();
+    }
+
+#if OTAM_ENABLE_LOG_UPLOAD
+    // The server acknowledges how many of the sent log messages it stored
+    int logAck = reply.getIntValue(OTAM_FIELD_LOG_ACK);
+    dropQueuedLogs(logAck < 0 ? 0 : min(logAck, sentLogCount));
+#endif
+
+#if OTAM_ENABLE_SPOOL
+    // The server is reachable again, catch up on spooled reports
+    reportSpool.replay();
+#endif
+
+    return applyDeviceStatus(reply);
+}
+
+// The sync through the separate init, log and status requests
+boolean OtamClient::syncSeparately() {
+    if (!deviceInitialized) {
+        initialize();
+    }
+
+#if OTAM_ENABLE_LOG_UPLOAD
+    while (queuedLogCount > 0) {
+        OtamHttpResponse response = logDeviceMessage(queuedLogs[0]);
+        bool delivered = response.httpCode > 0 && response.httpCode < 500;
+#if OTAM_ENABLE_SPOOL
+        // An undelivered message has been taken over by the spool
+        delivered = delivered || reportSpool.isEnabled();
+#endif
+
+        // Keep the rest for the next sync
+        if (!delivered) {
+            break;
+        }
+        dropQueuedLogs(1);
+    }
+#endif
+
+    return hasPendingUpdate();
+}
 
 // Check if a firmware update is available
 boolean OtamClient::hasPendingUpdate() {
+    OTAM_TRACE("OtamClient::hasPendingUpdate");
+    handleVerificationTimeout();
+
     if (!deviceInitialized) {
         initialize();
     }
 
     if (!updateStarted) {
+        String statusUrl = otamDevice->deviceStatusUrl;
+#if OTAM_ENABLE_VITALS
+        // Piggyback the vitals that changed since the last acknowledged poll
+        statusUrl += deviceVitals.toQueryString();
+#endif
+
         // Get the device status from the server
-        OtamHttpResponse response = OtamHttp::get(otamDevice->deviceStatusUrl);
+        OtamHttpResponse response = OtamHttp::get(statusUrl);
 
         if (response.httpCode == 200) {
-            // Get the device status from the response
-            String deviceStatus = LightJson::getValue(response.payload.c_str(), "deviceStatus");
-
-            // Check if the device status is UPDATE_PENDING
-            if (deviceStatus.equals("UPDATE_PENDING")) {
-                firmwareUpdateValues.firmwareFileId =
-                    LightJson::getIntValue(response.payload.c_str(), "firmwareFileId");
-                firmwareUpdateValues.firmwareId =
-                    LightJson::getIntValue(response.payload.c_str(), "firmwareId");
-                firmwareUpdateValues.firmwareName =
-                    LightJson::getValue(response.payload.c_str(), "firmwareName");
-                firmwareUpdateValues.firmwareVersion =
-                    LightJson::getValue(response.payload.c_str(), "firmwareVersion");
-
-                return true;
-            }
+#if OTAM_ENABLE_VITALS
+            deviceVitals.acknowledge();
+#endif
+
+#if OTAM_ENABLE_SPOOL
+            // The server is reachable again, catch up on spooled reports
+            reportSpool.replay();
+#endif
+
+            OtamPayloadReader status(response.payload, response.compact);
+
+            return applyDeviceStatus(status);
         }
     }
 
     return false;
 }
 
-// Perform the firmware update
-void OtamClient::doFirmwareUpdate() {
+// Persist the values of the firmware update being installed
+void OtamClient::storeFirmwareUpdateValues() {
+    // Store the updated firmware file id
+    OtamStore::writeFirmwareUpdateFileIdToStore(firmwareUpdateValues.firmwareFileId);
+    // OTAM_LOG("Firmware update file ID stored: " +
+    //                       String(firmwareUpdateValues.firmwareFileId));
+
+    // Store the updated firmware id
+    OtamStore::writeFirmwareUpdateIdToStore(firmwareUpdateValues.firmwareId);
+    // OTAM_LOG("Firmware update ID stored: " + String(firmwareUpdateValues.firmwareId));
+
+#if OTAM_ENABLE_FIRMWARE_STRINGS
+    // Store the updated firmware name
+    OtamStore::writeFirmwareUpdateNameToStore(firmwareUpdateValues.firmwareName);
+    // OTAM_LOG("Firmware update name stored: " + firmwareUpdateValues.firmwareName);
+
+    // Store the updated firmware version
+    OtamStore::writeFirmwareUpdateVersionToStore(firmwareUpdateValues.firmwareVersion);
+    // OTAM_LOG("Firmware update version stored: " + firmwareUpdateValues.firmwareVersion);
+#endif
+}
+
+// Read the values of the last installed firmware update
+FirmwareUpdateValues OtamClient::readStoredFirmwareUpdateValues() {
+    FirmwareUpdateValues values;
+    values.firmwareFileId = OtamStore::readFirmwareUpdateFileIdFromStore();
+    values.firmwareId = OtamStore::readFirmwareUpdateIdFromStore();
+#if OTAM_ENABLE_FIRMWARE_STRINGS
+    values.firmwareName = OtamStore::readFirmwareUpdateNameFromStore();
+    values.firmwareVersion = OtamStore::readFirmwareUpdateVersionFromStore();
+#endif
+    return values;
+}
+
+// Download figures of the update that just finished
+OtamClient::UpdateStats OtamClient::collectUpdateStats() {
+    UpdateStats stats;
+    stats.download = downloadThrottle.getStats();
+#if OTAM_ENABLE_MIRRORS
+    stats.mirrorCount = firmwareMirrorCount;
+    for (int i = 0; i < firmwareMirrorCount; i++) {
+        stats.mirrors[i] = mirrorStats[i];
+    }
+#endif
+    return stats;
+}
+
+// Report a successful firmware update to the server
+void OtamClient::postFirmwareUpdateSuccess(const UpdateStats& stats) {
+    OTAM_LOG("OTAM: Updating device status on server with the following values:");
+    OTAM_LOG("POST Url: " + otamDevice->deviceStatusUrl);
+    OTAM_LOG("Firmware file ID: " + String(firmwareUpdateValues.firmwareFileId));
+    OTAM_LOG("Firmware ID: " + String(firmwareUpdateValues.firmwareId));
+#if OTAM_ENABLE_FIRMWARE_STRINGS
+    OTAM_LOG("Firmware name: " + firmwareUpdateValues.firmwareName);
+    OTAM_LOG("Firmware version: " + firmwareUpdateValues.firmwareVersion);
+#endif
+
+    // Build the status payload in the negotiated encoding
+    OtamPayload payload;
+    payload.add(OTAM_FIELD_DEVICE_STATUS, "UPDATE_SUCCESS");
+    payload.add(OTAM_FIELD_FIRMWARE_FILE_ID, firmwareUpdateValues.firmwareFileId);
+    payload.add(OTAM_FIELD_FIRMWARE_ID, firmwareUpdateValues.firmwareId);
+#if OTAM_ENABLE_FIRMWARE_STRINGS
+    payload.add(OTAM_FIELD_FIRMWARE_VERSION, firmwareUpdateValues.firmwareVersion);
+#endif
+
+    // Report the achieved download rate against the configured cap
+    const OtamDownloadStats& downloadStats = stats.download;
+    if (downloadStats.bytes > 0) {
+        OTAM_LOG("OTAM: Download rate " + String(downloadStats.achievedRate) + " bytes/s, cap " +
+                 String(downloadStats.rateLimit) + " bytes/s");
+        payload.add(OTAM_FIELD_DOWNLOAD_RATE, (int)downloadStats.achievedRate);
+        payload.add(OTAM_FIELD_DOWNLOAD_RATE_LIMIT, (int)downloadStats.rateLimit);
+    }
+
+#if OTAM_ENABLE_MIRRORS
+    // Probe and transfer figures of every mirror, in server rank order
+    bool mirrorsUsed = false;
+    for (int i = 0; i < stats.mirrorCount; i++) {
+        mirrorsUsed = mirrorsUsed || stats.mirrors[i].bytes > 0;
+    }
+    if (mirrorsUsed) {
+        payload.beginArray(OTAM_FIELD_MIRROR_STATS);
+        for (int i = 0; i < stats.mirrorCount; i++) {
+            const OtamMirrorStats& mirror = stats.mirrors[i];
+            payload.beginObject();
+            payload.add(OTAM_FIELD_MIRROR_RANK, i);
+            payload.add(OTAM_FIELD_TIME_TO_FIRST_BYTE, mirror.timeToFirstByte);
+            payload.add(OTAM_FIELD_DOWNLOAD_BYTES, (int)mirror.bytes);
+            payload.add(OTAM_FIELD_DOWNLOAD_RATE,
+                        mirror.durationMs > 0 ? (int)((uint64_t)mirror.bytes * 1000 / mirror.durationMs) : 0);
+            payload.end();
+        }
+        payload.end();
+    }
+#endif
+
+    // Update device on the server
+    OtamHttpResponse response = postReport(otamDevice->deviceStatusUrl, payload);
+
+    OTAM_LOG("OTAM: Post Response - " + response.payload);
+}
+
+// Record a successful firmware update and hand over to the reboot
+void OtamClient::completeFirmwareUpdate() {
+    // Store the updated firmware values
+    storeFirmwareUpdateValues();
+    UpdateStats stats = collectUpdateStats();
+
+    if (clientOtamConfig.bootValidationTimeout > 0) {
+        // The new image has to confirm it is healthy before the update counts,
+        // the download figures are gone after the reboot unless stored
+        OtamStore::writeUpdateStatsToStore(&stats, sizeof(stats));
+        OtamStore::writePreviousPartitionToStore(esp_ota_get_running_partition()->label);
+        OtamStore::writeVerifyBootCountToStore(0);
+        OtamStore::writeFirmwareUpdateStatusToStore("UPDATE_VERIFYING");
+    } else {
+        postFirmwareUpdateSuccess(stats);
+
+        // Store firmware update status
+        OtamStore::writeFirmwareUpdateStatusToStore("UPDATE_SUCCESS");
+        // OTAM_LOG("Firmware update status stored: UPDATE_SUCCESS");
+    }
+
+    // Publish to the on before reboot callback
+    OTAM_CALLBACK(otaBeforeRebootCallback);
+
+    OTAM_LOG("OTAM: Rebooting device");
+
+    // Restart the device
+    // ESP.restart();
+    // esp_deep_sleep_start();
+}
+
+// Remember a downloaded and verified image until activateUpdate is called
+void OtamClient::stageFirmwareUpdate(String partitionLabel) {
+    OTAM_LOG("OTAM: Firmware update staged in partition " + partitionLabel);
+
+    storeFirmwareUpdateValues();
+    OtamStore::writeStagedPartitionToStore(partitionLabel);
+    OtamStore::writeFirmwareUpdateStatusToStore("UPDATE_STAGED");
+
+    updateStarted = false;
+}
+
+// Download the firmware update, optionally switching the boot partition to it
+bool OtamClient::runFirmwareUpdate(bool activate) {
     if (!otamDevice) {
         initialize();
     }
 
+    // The inactive partition holds the image a revert goes back to
+    if (isUpdateBeingVerified()) {
+        OTAM_LOG("OTAM: Firmware update is pending verification, call confirmHealthy first");
+        return false;
+    }
+
     updateStarted = true;
 
-    // Serial.println("Firmware update started");
+    // OTAM_LOG("Firmware update started");
 
-    HTTPClient http;
+    OtamUpdater otamUpdater;
 
-    // Serial.println("Getting device firmware file url from: " + otamDevice->deviceFirmwareFileUrl);
+#if OTAM_ENABLE_CALLBACKS
+    // Subscribe to the OTA download progress callback
+    otamUpdater.onOtaDownloadProgress(&otaDownloadProgressCallback);
+#endif
 
-    // Get the device status from the server
-    OtamHttpResponse response = OtamHttp::get(otamDevice->deviceFirmwareFileUrl);
+    // Apply the bandwidth cap for this kind of download
+    downloadThrottle.configure(
+        activate ? clientOtamConfig.downloadRateLimit : clientOtamConfig.stagedDownloadRateLimit,
+        clientOtamConfig.adaptiveDownloadRate);
+    otamUpdater.setThrottle(&downloadThrottle);
 
-    if (response.httpCode != 200 || response.payload == "") {
-        String error = "Firmware file url request failed, error: " + String(response.httpCode);
-        updateStarted = false;
-        if (otaErrorCallback) {
-            otaErrorCallback(firmwareUpdateValues, error);
+    // The peer and staged records must not point at the partition about to be overwritten
+    const esp_partition_t* updatePartition = esp_ota_get_next_update_partition(NULL);
+#if OTAM_ENABLE_PEERS
+    if (updatePartition && OtamStore::readPeerPartitionFromStore() == updatePartition->label) {
+        OtamStore::writePeerFileIdToStore(0);
+    }
+#endif
+    if (updatePartition && hasStagedUpdate() &&
+        OtamStore::readStagedPartitionFromStore() == updatePartition->label) {
+        clearStagedUpdate();
+    }
+
+    // Check the device can take the image and erase the partition before downloading
+    if (clientOtamConfig.preflightChecks) {
+        String error = "";
+        int minFreeHeap = clientOtamConfig.preflightMinFreeHeap;
+        if (!otamUpdater.preflight(firmwareUpdateValues.firmwareFileSize, minFreeHeap, error)) {
+            failFirmwareUpdate(error);
+            return false;
         }
-        sendOtaUpdateError(error);
-        return;
     }
 
-    // Serial.println("Downloading firmware file bin from: " + response.payload);
+    // Publish to the before download callback
+    OTAM_CALLBACK(otaBeforeDownloadCallback);
+
+#if OTAM_ENABLE_PEERS
+    // Try LAN peers first, only when the image can be verified against the server hash
+    if (firmwareUpdateValues.firmwareFileHash.length() == 32) {
+        // The mDNS query blocks for seconds, it only runs when a download is certain
+        collectFirmwarePeers();
+
+        for (int i = 0; i < firmwarePeerCount; i++) {
+            String peerUrl = firmwarePeers[i] + OtamPeerServer::firmwarePath +
+                             String(firmwareUpdateValues.firmwareFileId);
+            OTAM_LOG("OTAM: Downloading firmware from peer " + firmwarePeers[i]);
 
-    // Check if payload begins with http
+            int peerHttpCode = 0;
+            String peerError = "";
+            if (downloadFirmware(otamUpdater, peerUrl, false, peerHttpCode, peerError)) {
+                return finishFirmwareDownload(otamUpdater, activate);
+            }
+            OTAM_LOG("OTAM: Peer download failed, error: " + String(peerHttpCode) + " " + peerError);
+        }
+    }
+#endif
+
+#if OTAM_ENABLE_MIRRORS
+    // Download from the fastest mirror, continuing on the next one when it stalls.
+    // The mirror urls expire together with the prefetched firmware file url.
+    for (int i = 0; i < maxFirmwareMirrors; i++) {
+        mirrorStats[i] = OtamMirrorStats();
+    }
+    if (firmwareMirrorCount > 0 && !firmwareFileUrlExpired()) {
+        String mirrorError = "";
+        if (downloadFromMirrors(otamUpdater, mirrorError)) {
+            return finishFirmwareDownload(otamUpdater, activate);
+        }
+        OTAM_LOG("OTAM: Mirror download failed, error: " + mirrorError);
+    }
+#endif
+
+    // Use the firmware file url prefetched with the status poll when it is still valid
+    bool usedPrefetchedUrl = false;
     String url = "";
-    if (response.payload.startsWith("http")) {
-        url = response.payload;
+    if (firmwareUpdateValues.firmwareFileUrl != "" && !firmwareFileUrlExpired()) {
+        url = toAbsoluteUrl(firmwareUpdateValues.firmwareFileUrl);
+        usedPrefetchedUrl = true;
     } else {
-        url = clientOtamConfig.url + response.payload;
+        String error = "";
+        url = requestFirmwareFileUrl(error);
+        if (url == "") {
+            failFirmwareUpdate(error);
+            return false;
+        }
     }
 
-    http.begin(url);
-    http.addHeader("x-api-key", clientOtamConfig.apiKey);
+    // OTAM_LOG("Downloading firmware file bin from: " + url);
 
-    // Publish to the before download callback
-    if (otaBeforeDownloadCallback) {
-        otaBeforeDownloadCallback();
+    // Start the download
+    int httpCode = 0;
+    String downloadError = "";
+    bool downloaded = downloadFirmware(otamUpdater, url, true, httpCode, downloadError);
+
+    // The prefetched url may have been revoked early, retry once with a fresh one
+    if (httpCode != HTTP_CODE_OK && usedPrefetchedUrl) {
+        // OTAM_LOG("Prefetched firmware file url rejected, error: " + String(httpCode));
+        String error = "";
+        url = requestFirmwareFileUrl(error);
+        if (url == "") {
+            failFirmwareUpdate(error);
+            return false;
+        }
+
+        downloaded = downloadFirmware(otamUpdater, url, true, httpCode, downloadError);
     }
 
-    // Start the download
-    int httpCode = http.GET();
+    // OTAM_LOG("HTTP GET response code: " + String(httpCode));
+
+    if (httpCode != HTTP_CODE_OK) {
+        failFirmwareUpdate("Firmware download failed, error: " + String(httpCode));
+        return false;
+    }
+
+    if (!downloaded) {
+        failFirmwareUpdate(downloadError);
+        return false;
+    }
 
-    // Serial.println("HTTP GET response code: " + String(httpCode));
+    return finishFirmwareDownload(otamUpdater, activate);
+}
+
+// Download the firmware file from a url into the inactive partition
+bool OtamClient::downloadFirmware(OtamUpdater& otamUpdater, String url, bool sendApiKey, int& httpCode,
+                                  String& error) {
+    WiFiClient client;
+    HTTPClient http;
 
+    OtamHttp::begin(http, client, url);
+
+    // Never hand the api key to LAN peers
+    if (sendApiKey) {
+        http.addHeader("x-api-key", clientOtamConfig.apiKey);
+    }
+
+    OTAM_CAPTURE(request("GET", url, nullptr, 0));
+    httpCode = http.GET();
+    OTAM_CAPTURE(response(httpCode, http.getSize(), ""));
+
+    bool downloaded = false;
     if (httpCode == HTTP_CODE_OK) {
         // Status 200 : Download available
 
-        // Serial.println("New firmware available");
+        // OTAM_LOG("New firmware available");
 
-        OtamUpdater* otamUpdater = new OtamUpdater();
+        downloaded = otamUpdater.runESP32Update(http, firmwareUpdateValues.firmwareFileHash, error);
+    }
 
-        // Subscribe to the OTA download progress callback
-        otamUpdater->onOtaDownloadProgress([this](int progress) {
-            if (otaDownloadProgressCallback) {
-                otaDownloadProgressCallback(progress);
-            }
-        });
+    http.end();
+    OTAM_CAPTURE(finish());
 
-        // Subscribe to the OTA after download callback
-        otamUpdater->onOtaAfterDownload([this]() {
-            if (otaAfterDownloadCallback) {
-                otaAfterDownloadCallback();
-            }
-        });
-
-        otamUpdater->onOtaSuccess([this]() {
-            Serial.println("OTAM: OTA success callback called");
-
-            Serial.println("OTAM: Updating device status on server with the following values:");
-            Serial.println("POST Url: " + otamDevice->deviceStatusUrl);
-            Serial.println("Firmware file ID: " + String(firmwareUpdateValues.firmwareFileId));
-            Serial.println("Firmware ID: " + String(firmwareUpdateValues.firmwareId));
-            Serial.println("Firmware name: " + firmwareUpdateValues.firmwareName);
-            Serial.println("Firmware version: " + firmwareUpdateValues.firmwareVersion);
-
-            // Create JSON objects for each field
-            String statusObj = LightJson::createObject("deviceStatus", "UPDATE_SUCCESS");
-            String fileIdObj = LightJson::createObject("firmwareFileId", firmwareUpdateValues.firmwareFileId);
-            String firmwareIdObj = LightJson::createObject("firmwareId", firmwareUpdateValues.firmwareId);
-            String versionObj =
-                LightJson::createObject("firmwareVersion", firmwareUpdateValues.firmwareVersion.c_str());
-
-            // Merge all objects
-            String payload = LightJson::mergeObjects(statusObj.c_str(), fileIdObj.c_str());
-            payload = LightJson::mergeObjects(payload.c_str(), firmwareIdObj.c_str());
-            payload = LightJson::mergeObjects(payload.c_str(), versionObj.c_str());
-
-            // Update device on the server
-            OtamHttpResponse response = OtamHttp::post(otamDevice->deviceStatusUrl, payload);
-
-            Serial.println("OTAM: Post Response - " + response.payload);
-
-            // Store the updated firmware file id
-            OtamStore::writeFirmwareUpdateFileIdToStore(firmwareUpdateValues.firmwareFileId);
-            // Serial.println("Firmware update file ID stored: " +
-            //                       String(firmwareUpdateValues.firmwareFileId));
-
-            // Store the updated firmware id
-            OtamStore::writeFirmwareUpdateIdToStore(firmwareUpdateValues.firmwareId);
-            // Serial.println("Firmware update ID stored: " + String(firmwareUpdateValues.firmwareId));
-
-            // Store the updated firmware name
-            OtamStore::writeFirmwareUpdateNameToStore(firmwareUpdateValues.firmwareName);
-            // Serial.println("Firmware update name stored: " + firmwareUpdateValues.firmwareName);
-
-            // Store the updated firmware version
-            OtamStore::writeFirmwareUpdateVersionToStore(firmwareUpdateValues.firmwareVersion);
-            // Serial.println("Firmware update version stored: " + firmwareUpdateValues.firmwareVersion);
-
-            // Store firmware update status
-            OtamStore::writeFirmwareUpdateStatusToStore("UPDATE_SUCCESS");
-            // Serial.println("Firmware update status stored: UPDATE_SUCCESS");
-
-            // Publish to the on before reboot callback
-            if (otaBeforeRebootCallback) {
-                otaBeforeRebootCallback();
-            }
+    return downloaded;
+}
+
+#if OTAM_ENABLE_MIRRORS
+// A mirror that answered the probe beats one that did not, then the lower time to first byte wins
+static bool isFasterMirror(const OtamMirrorStats& mirror, const OtamMirrorStats& other) {
+    if (mirror.timeToFirstByte < 0) {
+        return false;
+    }
+    return other.timeToFirstByte < 0 || mirror.timeToFirstByte < other.timeToFirstByte;
+}
 
-            Serial.println("OTAM: Rebooting device");
+// Measure the time to first byte of every mirror and order them fastest first
+void OtamClient::probeFirmwareMirrors() {
+    for (int i = 0; i < firmwareMirrorCount; i++) {
+        firmwareMirrorOrder[i] = i;
+    }
 
-            // Restart the device
-            // ESP.restart();
-            // esp_deep_sleep_start();
-        });
+    // A single mirror is used without probing
+    if (firmwareMirrorCount < 2) {
+        return;
+    }
 
-        otamUpdater->onOtaError([this](String error) {
-            Serial.println("OTA error callback called");
-            updateStarted = false;
-            if (otaErrorCallback) {
-                otaErrorCallback(firmwareUpdateValues, error);
+    for (int i = 0; i < firmwareMirrorCount; i++) {
+        WiFiClient client;
+        HTTPClient http;
+        http.setConnectTimeout(MIRROR_PROBE_TIMEOUT_MS);
+        http.setTimeout(MIRROR_PROBE_TIMEOUT_MS);
+        OtamHttp::begin(http, client, toAbsoluteUrl(firmwareMirrors[i]), MIRROR_PROBE_TIMEOUT_MS);
+        http.addHeader("x-api-key", clientOtamConfig.apiKey);
+        http.addHeader("Range", "bytes=0-0");
+
+        OTAM_CAPTURE(request("GET", firmwareMirrors[i], nullptr, 0));
+        unsigned long startedAt = millis();
+        int httpCode = http.GET();
+        if (httpCode == HTTP_CODE_OK || httpCode == HTTP_CODE_PARTIAL_CONTENT) {
+            mirrorStats[i].timeToFirstByte = millis() - startedAt;
+        }
+        OTAM_CAPTURE(response(httpCode, http.getSize(), ""));
+        http.end();
+        OTAM_CAPTURE(finish());
+
+        OTAM_LOG("OTAM: Mirror " + String(i) + " time to first byte: " +
+                 String(mirrorStats[i].timeToFirstByte) + " ms");
+    }
+
+    // Insertion sort keeps the server ranking between equally fast mirrors
+    for (int i = 1; i < firmwareMirrorCount; i++) {
+        int mirror = firmwareMirrorOrder[i];
+        int j = i;
+        while (j > 0 && isFasterMirror(mirrorStats[mirror], mirrorStats[firmwareMirrorOrder[j - 1]])) {
+            firmwareMirrorOrder[j] = firmwareMirrorOrder[j - 1];
+            j--;
+        }
+        firmwareMirrorOrder[j] = mirror;
+    }
+}
+
+// Download the firmware from the mirrors, fastest first. When a mirror stalls
+// or drops below mirrorMinRate the next one continues with a range request
+// from the offset already written and hashed.
+bool OtamClient::downloadFromMirrors(OtamUpdater& otamUpdater, String& error) {
+    probeFirmwareMirrors();
+
+    static const char* headerKeys[] = {"Content-Range"};
+
+    for (int i = 0; i < firmwareMirrorCount; i++) {
+        int mirror = firmwareMirrorOrder[i];
+        size_t offset = otamUpdater.getWrittenSize();
+
+        WiFiClient client;
+        HTTPClient http;
+        OtamHttp::begin(http, client, toAbsoluteUrl(firmwareMirrors[mirror]));
+        http.addHeader("x-api-key", clientOtamConfig.apiKey);
+        if (offset > 0) {
+            OTAM_LOG("OTAM: Resuming firmware download at byte " + String(offset) + " from mirror " +
+                     String(mirror));
+            http.addHeader("Range", "bytes=" + String(offset) + "-");
+            http.collectHeaders(headerKeys, 1);
+        } else {
+            OTAM_LOG("OTAM: Downloading firmware from mirror " + String(mirror));
+        }
+
+        OTAM_CAPTURE(request("GET", firmwareMirrors[mirror], nullptr, 0));
+        unsigned long startedAt = millis();
+        int httpCode = http.GET();
+        OTAM_CAPTURE(response(httpCode, http.getSize(),
+                              offset > 0 ? "Content-Range: " + http.header("Content-Range") + "\n" : ""));
+
+        int imageSize = 0;
+        if (offset == 0 && httpCode == HTTP_CODE_OK) {
+            imageSize = http.getSize();
+        } else if (offset > 0 && httpCode == HTTP_CODE_PARTIAL_CONTENT) {
+            // Content-Range: bytes <first>-<last>/<size>, the range has to start at the offset
+            String contentRange = http.header("Content-Range");
+            int dash = contentRange.indexOf('-');
+            int slash = contentRange.indexOf('/');
+            if (contentRange.startsWith("bytes ") && dash > 0 && slash > dash &&
+                (size_t)contentRange.substring(6, dash).toInt() == offset) {
+                imageSize = contentRange.substring(slash + 1).toInt();
             }
-            sendOtaUpdateError(error);
-        });
-        otamUpdater->runESP32Update(http);
-    } else {
-        String error = "Firmware download failed, error: " + String(httpCode);
-        updateStarted = false;
-        if (otaErrorCallback) {
-            otaErrorCallback(firmwareUpdateValues, error);
         }
-        sendOtaUpdateError(error);
+
+        if (imageSize <= 0 || !otamUpdater.beginDownload(imageSize, error)) {
+            OTAM_LOG("OTAM: Mirror " + String(mirror) + " rejected the download, error: " + String(httpCode));
+            http.end();
+            OTAM_CAPTURE(finish());
+            continue;
+        }
+
+        // The last mirror is kept however slow it is
+        uint32_t minRate = i < firmwareMirrorCount - 1 ? clientOtamConfig.mirrorMinRate : 0;
+        OtamStreamResult result = otamUpdater.writeStream(http, minRate, error);
+        if (result == OTAM_STREAM_FAILED) {
+            http.end();
+            OTAM_CAPTURE(finish());
+            return false;
+        }
+
+        mirrorStats[mirror].bytes += otamUpdater.getWrittenSize() - offset;
+        mirrorStats[mirror].durationMs += millis() - startedAt;
+        http.end();
+        OTAM_CAPTURE(finish());
+
+        if (result == OTAM_STREAM_COMPLETE) {
+            return otamUpdater.finishDownload(firmwareUpdateValues.firmwareFileHash, error);
+        }
+
+        OTAM_LOG("OTAM: Mirror " + String(mirror) +
+                 (result == OTAM_STREAM_SLOW ? " too slow" : " stopped sending") + ", switching mirror");
     }
+
+    error = "No firmware mirror completed the download";
+    return false;
+}
+#endif
+
+// Activate or stage a downloaded and verified firmware image
+bool OtamClient::finishFirmwareDownload(OtamUpdater& otamUpdater, bool activate) {
+    // Publish to the after download callback
+    OTAM_CALLBACK(otaAfterDownloadCallback);
+
+    // Remember the verified image before a reboot can happen
+    recordPeerImage(otamUpdater);
+
+    if (!activate) {
+        // Keep the boot partition when staging, the image is activated later
+        stageFirmwareUpdate(otamUpdater.getUpdatePartitionLabel());
+        return true;
+    }
+
+    String error = "";
+    if (!otamUpdater.activate(error)) {
+        failFirmwareUpdate(error);
+        return false;
+    }
+
+    completeFirmwareUpdate();
+    return true;
+}
+
+// Add LAN peers advertising the pending firmware file over mDNS
+void OtamClient::collectFirmwarePeers() {
+#if OTAM_ENABLE_PEERS
+    if (clientOtamConfig.peerDiscovery && firmwarePeerCount < maxFirmwarePeers) {
+        firmwarePeerCount += OtamPeerServer::discoverPeers(firmwareUpdateValues.firmwareFileId,
+                                                           firmwarePeers + firmwarePeerCount,
+                                                           maxFirmwarePeers - firmwarePeerCount);
+    }
+#endif
+}
+
+// Remember the verified image so it can be served to LAN peers
+void OtamClient::recordPeerImage(OtamUpdater& otamUpdater) {
+#if OTAM_ENABLE_PEERS
+    if (firmwareUpdateValues.firmwareFileHash.length() != 32) {
+        return;
+    }
+
+    OtamStore::writePeerPartitionToStore(otamUpdater.getUpdatePartitionLabel());
+    OtamStore::writePeerFileSizeToStore(otamUpdater.getWrittenSize());
+    OtamStore::writePeerFileHashToStore(firmwareUpdateValues.firmwareFileHash);
+    OtamStore::writePeerFileIdToStore(firmwareUpdateValues.firmwareFileId);
+    peerServer.advertiseFirmware(firmwareUpdateValues.firmwareFileId);
+#endif
+}
+
+#if OTAM_ENABLE_PEERS
+// Serve LAN peer firmware requests, call from the application loop
+void OtamClient::handlePeerRequests() {
+    peerServer.handle();
+}
+#endif
+
+// Perform the firmware update
+void OtamClient::doFirmwareUpdate() {
+    OTAM_TRACE("OtamClient::doFirmwareUpdate");
+    runFirmwareUpdate(true);
+}
+
+// Signal application load so an adaptive download backs off
+void OtamClient::setApplicationBusy(bool busy) {
+    downloadThrottle.setApplicationBusy(busy);
+}
+
+// Get the rate statistics of the last firmware download
+OtamDownloadStats OtamClient::getDownloadStats() {
+    return downloadThrottle.getStats();
+}
+
+#if OTAM_ENABLE_DNS_CACHE
+// Resolver cache counters, kept across deep sleep
+OtamDnsStats OtamClient::getDnsStats() {
+    return OtamDnsCache::getStats();
+}
+#endif
+
+#if OTAM_ENABLE_SPOOL
+// Number of reports waiting in the offline spool
+int OtamClient::getSpooledReportCount() {
+    return reportSpool.size();
+}
+#endif
+
+// Download and verify the firmware update into the inactive partition without activating it
+bool OtamClient::stageUpdate() {
+    OTAM_TRACE("OtamClient::stageUpdate");
+    return runFirmwareUpdate(false);
+}
+
+// Check if a verified firmware image is waiting in the inactive partition
+bool OtamClient::hasStagedUpdate() {
+    if (OtamStore::readFirmwareUpdateStatusFromStore() != "UPDATE_STAGED") {
+        return false;
+    }
+
+    // The staged image is gone once the device runs from its partition
+    String stagedPartition = OtamStore::readStagedPartitionFromStore();
+    const esp_partition_t* runningPartition = esp_ota_get_running_partition();
+    return stagedPartition != "" && stagedPartition != runningPartition->label;
+}
+
+// Forget the staged image
+void OtamClient::clearStagedUpdate() {
+    OtamStore::writeStagedPartitionToStore("");
+    OtamStore::writeFirmwareUpdateStatusToStore("NONE");
+}
+
+// Switch the boot partition to the staged image, the next boot or wake runs it
+void OtamClient::activateUpdate() {
+    OTAM_TRACE("OtamClient::activateUpdate");
+    if (!deviceInitialized) {
+        initialize();
+    }
+
+    if (!hasStagedUpdate()) {
+        OTAM_LOG("OTAM: No staged firmware update to activate");
+        return;
+    }
+
+    // Restore the values of the staged firmware update
+    firmwareUpdateValues = readStoredFirmwareUpdateValues();
+
+    String stagedPartition = OtamStore::readStagedPartitionFromStore();
+
+    const esp_partition_t* partition =
+        esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_ANY, stagedPartition.c_str());
+    if (!partition) {
+        clearStagedUpdate();
+        failFirmwareUpdate("Staged partition " + stagedPartition + " not found");
+        return;
+    }
+
+    // Setting the boot partition validates the staged image again
+    esp_err_t err = esp_ota_set_boot_partition(partition);
+    if (err != ESP_OK) {
+        // A corrupt image can never be activated, other errors may pass on the next attempt
+        if (err == ESP_ERR_OTA_VALIDATE_FAILED) {
+            clearStagedUpdate();
+        }
+        failFirmwareUpdate("Staged firmware activation failed, error: " + String(esp_err_to_name(err)));
+        return;
+    }
+
+    clearStagedUpdate();
+
+    completeFirmwareUpdate();
 }
\ No newline at end of file
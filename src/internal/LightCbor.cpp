@@ -0,0 +1,338 @@
+#include "internal/LightCbor.h"
+
+// CBOR major types
+const uint8_t CBOR_UNSIGNED = 0;
+const uint8_t CBOR_NEGATIVE = 1;
+const uint8_t CBOR_BYTES = 2;
+const uint8_t CBOR_TEXT = 3;
+const uint8_t CBOR_ARRAY = 4;
+const uint8_t CBOR_MAP = 5;
+const uint8_t CBOR_TAG = 6;
+const uint8_t CBOR_SIMPLE = 7;
+
+const uint8_t CBOR_INDEFINITE = 31;
+const uint8_t CBOR_BREAK = 0xFF;
+
+// Nesting limit when skipping over values
+const int CBOR_MAX_DEPTH = 8;
+
+LightCborWriter::LightCborWriter(uint8_t* buffer, size_t capacity) : buffer(buffer), capacity(capacity) {}
+
+size_t LightCborWriter::headSize(uint32_t value) {
+    return value < 24 ? 1 : value <= 0xFF ? 2 : value <= 0xFFFF ? 3 : 5;
+}
+
+// Room left before the bytes reserved for closing the open containers
+size_t LightCborWriter::available() const {
+    return overflowed ? 0 : capacity - length - openContainers;
+}
+
+void LightCborWriter::writeBytes(const uint8_t* data, size_t size) {
+    if (size > available()) {
+        overflowed = true;
+        return;
+    }
+    memcpy(buffer + length, data, size);
+    length += size;
+}
+
+void LightCborWriter::writeHead(uint8_t majorType, uint32_t value) {
+    uint8_t head[5];
+    size_t headSize = 1;
+    if (value < 24) {
+        head[0] = (majorType << 5) | value;
+    } else if (value <= 0xFF) {
+        head[0] = (majorType << 5) | 24;
+        head[1] = value;
+        headSize = 2;
+    } else if (value <= 0xFFFF) {
+        head[0] = (majorType << 5) | 25;
+        head[1] = value >> 8;
+        head[2] = value;
+        headSize = 3;
+    } else {
+        head[0] = (majorType << 5) | 26;
+        head[1] = value >> 24;
+        head[2] = value >> 16;
+        head[3] = value >> 8;
+        head[4] = value;
+        headSize = 5;
+    }
+    writeBytes(head, headSize);
+}
+
+// Maps and arrays are written with indefinite length, close them with end()
+void LightCborWriter::beginContainer(uint8_t majorType) {
+    // The head and the reserved closing break
+    if (available() < 2) {
+        overflowed = true;
+        return;
+    }
+    buffer[length++] = (majorType << 5) | CBOR_INDEFINITE;
+    openContainers++;
+}
+
+void LightCborWriter::beginMap() {
+    beginContainer(CBOR_MAP);
+}
+
+void LightCborWriter::beginArray() {
+    beginContainer(CBOR_ARRAY);
+}
+
+// The break always fits, its byte was reserved when the container was opened
+void LightCborWriter::end() {
+    if (openContainers == 0) {
+        return;
+    }
+    openContainers--;
+    buffer[length++] = CBOR_BREAK;
+}
+
+void LightCborWriter::addInt(int32_t value) {
+    if (value < 0) {
+        writeHead(CBOR_NEGATIVE, (uint32_t)(-1 - value));
+    } else {
+        writeHead(CBOR_UNSIGNED, value);
+    }
+}
+
+void LightCborWriter::addString(const char* value) {
+    addString(value, strlen(value));
+}
+
+// A string that does not fit is cut short at a UTF-8 character boundary
+void LightCborWriter::addString(const char* value, size_t size) {
+    size_t room = available();
+    if (headSize(size) + size > room) {
+        size = room > headSize(room) ? room - headSize(room) : 0;
+        while (size > 0 && ((uint8_t)value[size] & 0xC0) == 0x80) {
+            size--;
+        }
+    }
+    writeHead(CBOR_TEXT, size);
+    writeBytes((const uint8_t*)value, size);
+}
+
+size_t LightCborWriter::size() const {
+    return length;
+}
+
+// Bytes that can still be written, not counting the reserved closing breaks
+size_t LightCborWriter::remaining() const {
+    return available();
+}
+
+bool LightCborWriter::ok() const {
+    return !overflowed;
+}
+
+// Drop everything written after mark and clear the overflow. Containers opened
+// after mark must have been closed again.
+void LightCborWriter::rollback(size_t mark) {
+    if (mark < length) {
+        length = mark;
+    }
+    overflowed = false;
+}
+
+String LightCbor::getValue(const uint8_t* data, size_t size, int keyId, const char* keyName) {
+    const uint8_t* value = findValue(data, size, keyId, keyName);
+    if (!value)
+        return "";
+    return itemToString(value, data + size);
+}
+
+int LightCbor::getIntValue(const uint8_t* data, size_t size, int keyId, const char* keyName) {
+    const uint8_t* value = findValue(data, size, keyId, keyName);
+    if (!value)
+        return 0;
+
+    uint8_t majorType;
+    uint32_t head;
+    bool indefinite;
+    if (!readHead(value, data + size, majorType, head, indefinite))
+        return 0;
+    if (majorType == CBOR_UNSIGNED)
+        return (int)head;
+    if (majorType == CBOR_NEGATIVE)
+        return -1 - (int)head;
+    return 0;
+}
+
+bool LightCbor::hasKey(const uint8_t* data, size_t size, int keyId, const char* keyName) {
+    return findValue(data, size, keyId, keyName) != nullptr;
+}
+
+String LightCbor::getArrayItem(const uint8_t* data, size_t size, int keyId, const char* keyName, int index) {
+    const uint8_t* end = data + size;
+    const uint8_t* current = findValue(data, size, keyId, keyName);
+    if (!current)
+        return "";
+
+    uint8_t majorType;
+    uint32_t count;
+    bool indefinite;
+    current = readHead(current, end, majorType, count, indefinite);
+    if (!current || majorType != CBOR_ARRAY)
+        return "";
+
+    for (uint32_t i = 0; indefinite || i < count; i++) {
+        if (current >= end || *current == CBOR_BREAK)
+            break;
+        if ((int)i == index)
+            return itemToString(current, end);
+        current = skipItem(current, end, 0);
+        if (!current)
+            break;
+    }
+    return "";
+}
+
+// Decode the initial byte and argument of an item, returns the position after the head
+const uint8_t* LightCbor::readHead(const uint8_t* current, const uint8_t* end, uint8_t& majorType,
+                                   uint32_t& value, bool& indefinite) {
+    if (current >= end)
+        return nullptr;
+
+    majorType = *current >> 5;
+    uint8_t additional = *current & 0x1F;
+    current++;
+    indefinite = false;
+
+    if (additional < 24) {
+        value = additional;
+        return current;
+    }
+    if (additional == CBOR_INDEFINITE) {
+        indefinite = true;
+        value = 0;
+        return current;
+    }
+
+    size_t argumentSize = additional == 24   ? 1
+                          : additional == 25 ? 2
+                          : additional == 26 ? 4
+                          : additional == 27 ? 8
+                                             : 0;
+    if (argumentSize == 0 || argumentSize > (size_t)(end - current))
+        return nullptr;
+
+    // 64 bit arguments are truncated, the OTAM fields never need them
+    uint64_t argument = 0;
+    for (size_t i = 0; i < argumentSize; i++) {
+        argument = (argument << 8) | current[i];
+    }
+    value = (uint32_t)argument;
+    return current + argumentSize;
+}
+
+const uint8_t* LightCbor::skipItem(const uint8_t* current, const uint8_t* end, int depth) {
+    if (depth > CBOR_MAX_DEPTH)
+        return nullptr;
+
+    uint8_t majorType;
+    uint32_t value;
+    bool indefinite;
+    current = readHead(current, end, majorType, value, indefinite);
+    if (!current)
+        return nullptr;
+
+    switch (majorType) {
+        case CBOR_UNSIGNED:
+        case CBOR_NEGATIVE:
+        case CBOR_SIMPLE:
+            // Floats carry their value in the head argument
+            return current;
+        case CBOR_BYTES:
+        case CBOR_TEXT:
+            if (indefinite) {
+                // Chunks of definite strings terminated by a break
+                while (current && current < end && *current != CBOR_BREAK) {
+                    current = skipItem(current, end, depth + 1);
+                }
+                return current && current < end ? current + 1 : nullptr;
+            }
+            return value <= (size_t)(end - current) ? current + value : nullptr;
+        case CBOR_TAG:
+            return skipItem(current, end, depth + 1);
+        case CBOR_ARRAY:
+        case CBOR_MAP: {
+            uint32_t items = majorType == CBOR_MAP ? value * 2 : value;
+            for (uint32_t i = 0; indefinite || i < items; i++) {
+                if (current >= end)
+                    return nullptr;
+                if (indefinite && *current == CBOR_BREAK)
+                    return current + 1;
+                current = skipItem(current, end, depth + 1);
+                if (!current)
+                    return nullptr;
+            }
+            return current;
+        }
+    }
+    return nullptr;
+}
+
+bool LightCbor::keyMatches(const uint8_t* current, const uint8_t* end, int keyId, const char* keyName) {
+    uint8_t majorType;
+    uint32_t value;
+    bool indefinite;
+    const uint8_t* data = readHead(current, end, majorType, value, indefinite);
+    if (!data || indefinite)
+        return false;
+    if (majorType == CBOR_UNSIGNED)
+        return (int)value == keyId;
+    if (majorType == CBOR_TEXT && keyName)
+        return value == strlen(keyName) && value <= (size_t)(end - data) && memcmp(data, keyName, value) == 0;
+    return false;
+}
+
+// Find the value of a key in the top level map
+const uint8_t* LightCbor::findValue(const uint8_t* data, size_t size, int keyId, const char* keyName) {
+    const uint8_t* end = data + size;
+    uint8_t majorType;
+    uint32_t count;
+    bool indefinite;
+    const uint8_t* current = readHead(data, end, majorType, count, indefinite);
+    if (!current || majorType != CBOR_MAP)
+        return nullptr;
+
+    for (uint32_t i = 0; indefinite || i < count; i++) {
+        if (current >= end || *current == CBOR_BREAK)
+            return nullptr;
+        bool matches = keyMatches(current, end, keyId, keyName);
+        current = skipItem(current, end, 0);
+        if (!current || current >= end)
+            return nullptr;
+        if (matches)
+            return current;
+        current = skipItem(current, end, 0);
+        if (!current)
+            return nullptr;
+    }
+    return nullptr;
+}
+
+// Render text strings and integers the way LightJson returns them
+String LightCbor::itemToString(const uint8_t* current, const uint8_t* end) {
+    uint8_t majorType;
+    uint32_t value;
+    bool indefinite;
+    const uint8_t* data = readHead(current, end, majorType, value, indefinite);
+    if (!data)
+        return "";
+
+    if (majorType == CBOR_TEXT && !indefinite && value <= (size_t)(end - data)) {
+        String result;
+        result.concat((const char*)data, value);
+        return result;
+    }
+    if (majorType == CBOR_UNSIGNED)
+        return String(value);
+    if (majorType == CBOR_NEGATIVE)
+        return String(-1 - (long)value);
+    if (majorType == CBOR_SIMPLE)
+        return value == 21 ? "true" : value == 20 ? "false" : "";
+    return "";
+}
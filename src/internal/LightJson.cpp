@@ -18,6 +18,26 @@ bool LightJson::hasKey(const char* json, const char* key) {
     return findKey(json, key) != nullptr;
 }
 
+String LightJson::getArrayItem(const char* json, const char* key, int index) {
+    const char* current = findValueStart(json, key);
+    if (!current || *current != '[')
+        return "";
+    current++;
+
+    int itemIndex = 0;
+    while (*current && *current != ']') {
+        while (*current && (isspace(*current) || *current == ','))
+            current++;
+        if (!*current || *current == ']')
+            break;
+        if (itemIndex == index)
+            return extractValue(current);
+        current = findValueEnd(current);
+        itemIndex++;
+    }
+    return "";
+}
+
 String LightJson::createObject(const char* key, const char* value) {
     return createObject(key, value, true);
 }
@@ -116,7 +136,7 @@ const char* LightJson::findValueEnd(const char* json) {
             current++;
         }
     } else {
-        while (*current && *current != ',' && *current != '}')
+        while (*current && *current != ',' && *current != '}' && *current != ']')
             current++;
     }
     return current;
@@ -0,0 +1,102 @@
+#include "internal/OtamCapture.h"
+
+#if OTAM_ENABLE_CAPTURE
+
+const uint8_t CAPTURE_VERSION = 1;
+
+Print* OtamCapture::sink = nullptr;
+bool OtamCapture::captureBodies = false;
+unsigned long OtamCapture::startedAt = 0;
+
+// Start recording to the sink. Without bodies only the size and timing of
+// every firmware read is kept, which is enough to replay a download slowly.
+// API responses are always recorded whole.
+void OtamCapture::begin(Print* captureSink, bool bodies) {
+    sink = captureSink;
+    captureBodies = bodies;
+    startedAt = millis();
+
+    if (sink) {
+        sink->print("OTAMCAP");
+        sink->write(CAPTURE_VERSION);
+    }
+}
+
+void OtamCapture::end() {
+    if (sink) {
+        sink->flush();
+    }
+    sink = nullptr;
+}
+
+void OtamCapture::writeUInt32(uint32_t value) {
+    uint8_t bytes[4] = {(uint8_t)value, (uint8_t)(value >> 8), (uint8_t)(value >> 16),
+                        (uint8_t)(value >> 24)};
+    sink->write(bytes, sizeof(bytes));
+}
+
+void OtamCapture::writeHeader(OtamCaptureRecord type, uint32_t length) {
+    sink->write((uint8_t)type);
+    writeUInt32(millis() - startedAt);
+    writeUInt32(length);
+}
+
+// Payload: method, NUL, url, NUL, body
+void OtamCapture::request(const char* method, const String& url, const uint8_t* body, size_t size) {
+    if (!sink) {
+        return;
+    }
+
+    size_t methodLength = strlen(method);
+    writeHeader(OTAM_CAPTURE_REQUEST, methodLength + 1 + url.length() + 1 + size);
+    sink->write((const uint8_t*)method, methodLength + 1);
+    sink->write((const uint8_t*)url.c_str(), url.length() + 1);
+    if (size > 0) {
+        sink->write(body, size);
+    }
+}
+
+// Payload: status code, content length (-1 if unknown), "Name: value\n" headers
+void OtamCapture::response(int httpCode, int contentLength, const String& headers) {
+    if (!sink) {
+        return;
+    }
+
+    writeHeader(OTAM_CAPTURE_RESPONSE, 8 + headers.length());
+    writeUInt32((uint32_t)httpCode);
+    writeUInt32((uint32_t)contentLength);
+    sink->write((const uint8_t*)headers.c_str(), headers.length());
+}
+
+// Payload: read size, then the bytes unless they are left out
+void OtamCapture::writeBody(const uint8_t* data, size_t size, bool withBytes) {
+    if (!sink) {
+        return;
+    }
+
+    writeHeader(OTAM_CAPTURE_BODY, 4 + (withBytes ? size : 0));
+    writeUInt32(size);
+    if (withBytes) {
+        sink->write(data, size);
+    }
+}
+
+// API response body, the replay needs it to drive the client
+void OtamCapture::body(const uint8_t* data, size_t size) {
+    writeBody(data, size, true);
+}
+
+// One read of a firmware download, the bytes only when bodies are captured
+void OtamCapture::streamBody(const uint8_t* data, size_t size) {
+    writeBody(data, size, captureBodies);
+}
+
+void OtamCapture::finish() {
+    if (!sink) {
+        return;
+    }
+
+    writeHeader(OTAM_CAPTURE_END, 0);
+}
+
+#endif
@@ -2,18 +2,18 @@
 
 void OtamDevice::writeIdToStore(String id) {
     OtamStore::writeDeviceGuidToStore(id);
-    // Serial.println("Device id written to store: " + id);
+    // OTAM_LOG("Device id written to store: " + id);
 }
 
 void OtamDevice::initialize(OtamConfig config) {
     // writeIdToStore("");
-    Serial.println("Initializing device with OTAM server");
+    OTAM_LOG("Initializing device with OTAM server");
 
     // Read the device id from the store
     String deviceGuidStore = OtamStore::readDeviceGuidFromStore();
 
     if (deviceGuidStore != "") {
-        Serial.println("Device GUID read from store: " + deviceGuidStore);
+        OTAM_LOG("Device GUID read from store: " + deviceGuidStore);
     }
 
     // Set the init url
@@ -21,28 +21,35 @@ void OtamDevice::initialize(OtamConfig config) {
 
     // Set the payload
     // With deviceId, deviceGuid, deviceProfileId
-    String payload = "{\"deviceId\":\"" + config.deviceId + "\",\"deviceGuid\":\"" + deviceGuidStore +
-                     "\",\"deviceProfileId\":" + config.deviceProfileId + "}";
+    OtamPayload payload;
+    payload.add(OTAM_FIELD_DEVICE_ID, config.deviceId);
+    payload.add(OTAM_FIELD_DEVICE_GUID, deviceGuidStore);
+    payload.add(OTAM_FIELD_DEVICE_PROFILE_ID, config.deviceProfileId);
 
-    Serial.println("Calling http post with payload: " + payload);
+    OTAM_LOG("Calling http post with " + String(payload.size()) + " byte " + payload.contentType() +
+             " payload");
 
     // Call the init endpoint
     OtamHttpResponse response = OtamHttp::post(initUrl, payload);
 
-    Serial.println("Received response from server");
+    OTAM_LOG("Received response from server");
 
     if (response.httpCode == 200) {
-        // Device found in OTAM DB
-        Serial.println("Device GUID returned from OTAM server: " + response.payload);
+        // Device found in OTAM DB, the JSON api returns the bare guid
+        String guid = response.payload;
+        if (response.compact) {
+            guid = OtamPayloadReader(response.payload, true).getValue(OTAM_FIELD_DEVICE_GUID);
+        }
+        OTAM_LOG("Device GUID returned from OTAM server: " + guid);
         // Set the device guid
-        deviceGuid = response.payload;
+        deviceGuid = guid;
         // Write the device guid to the store
-        writeIdToStore(response.payload);
+        writeIdToStore(guid);
         // Log success
-        Serial.println("Device has been initialized with OTAM server");
+        OTAM_LOG("Device has been initialized with OTAM server");
     } else {
-        Serial.println("Error Status code: " + response.httpCode);
-        Serial.println("Error Payload: " + response.payload);
+        OTAM_LOG("Error Status code: " + String(response.httpCode));
+        OTAM_LOG("Error Payload: " + response.payload);
     }
 }
 
@@ -50,6 +57,17 @@ OtamDevice::OtamDevice(OtamConfig config) {
     // Initialize device with OTAM server
     initialize(config);
 
+    setUrls(config);
+}
+
+// Device already initialized by the server, for example through a sync
+OtamDevice::OtamDevice(OtamConfig config, String knownDeviceGuid) {
+    deviceGuid = knownDeviceGuid;
+
+    setUrls(config);
+}
+
+void OtamDevice::setUrls(OtamConfig config) {
     // Set the device URL
     deviceUrl = config.url + "/devices/" + deviceGuid;
 
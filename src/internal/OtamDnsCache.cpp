@@ -0,0 +1,107 @@
+#include "internal/OtamDnsCache.h"
+
+#if OTAM_ENABLE_DNS_CACHE
+
+#include <sys/time.h>
+
+struct OtamDnsEntry {
+    char host[OTAM_DNS_CACHE_HOST_LENGTH];
+    uint32_t address;
+    int64_t resolvedAt;  // RTC clock seconds, 0 for an unused entry
+};
+
+// RTC memory keeps the entries and counters through deep sleep
+RTC_DATA_ATTR static OtamDnsEntry dnsEntries[OTAM_DNS_CACHE_SIZE];
+RTC_DATA_ATTR static OtamDnsStats dnsStats;
+
+uint32_t OtamDnsCache::ttl = 0;
+
+// The RTC clock keeps running in deep sleep, unlike millis()
+static int64_t rtcSeconds() {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return now.tv_sec;
+}
+
+// Set how long a resolved address is used before it is looked up again, 0 disables the cache
+void OtamDnsCache::configure(uint32_t ttlSeconds) {
+    ttl = ttlSeconds;
+}
+
+bool OtamDnsCache::isEnabled() {
+    return ttl > 0;
+}
+
+int OtamDnsCache::findEntry(const char* host) {
+    for (int i = 0; i < OTAM_DNS_CACHE_SIZE; i++) {
+        if (dnsEntries[i].resolvedAt != 0 && strcmp(dnsEntries[i].host, host) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Resolve a host name, from the cache while the entry is fresh
+bool OtamDnsCache::resolve(const String& host, IPAddress& address) {
+    // Addresses need no lookup
+    if (address.fromString(host)) {
+        return true;
+    }
+
+    if (host.length() >= OTAM_DNS_CACHE_HOST_LENGTH) {
+        return WiFi.hostByName(host.c_str(), address) == 1;
+    }
+
+    int64_t now = rtcSeconds();
+    int entry = findEntry(host.c_str());
+
+    // A clock that went backwards invalidates the entry as well
+    if (entry >= 0 && now >= dnsEntries[entry].resolvedAt && now - dnsEntries[entry].resolvedAt < ttl) {
+        dnsStats.hits++;
+        address = IPAddress(dnsEntries[entry].address);
+        return true;
+    }
+
+    if (WiFi.hostByName(host.c_str(), address) != 1) {
+        // Keep working on the last known address while DNS is unreachable
+        if (entry >= 0) {
+            OTAM_LOG("OTAM: DNS lookup for " + host + " failed, using cached address");
+            dnsStats.staleHits++;
+            address = IPAddress(dnsEntries[entry].address);
+            return true;
+        }
+        dnsStats.failures++;
+        return false;
+    }
+
+    dnsStats.misses++;
+
+    // Replace the oldest entry when the host is new
+    if (entry < 0) {
+        entry = 0;
+        for (int i = 1; i < OTAM_DNS_CACHE_SIZE; i++) {
+            if (dnsEntries[i].resolvedAt < dnsEntries[entry].resolvedAt) {
+                entry = i;
+            }
+        }
+        strcpy(dnsEntries[entry].host, host.c_str());
+    }
+    dnsEntries[entry].address = (uint32_t)address;
+    dnsEntries[entry].resolvedAt = now > 0 ? now : 1;
+
+    return true;
+}
+
+// Forget an address the host could not be reached on
+void OtamDnsCache::invalidate(const String& host) {
+    int entry = findEntry(host.c_str());
+    if (entry >= 0) {
+        dnsEntries[entry].resolvedAt = 0;
+    }
+}
+
+OtamDnsStats OtamDnsCache::getStats() {
+    return dnsStats;
+}
+
+#endif
@@ -1,32 +1,123 @@
 #include "internal/OtamHttp.h"
+#include "internal/OtamCapture.h"
+#include "internal/OtamTrace.h"
 
 String OtamHttp::apiKey;
+bool OtamHttp::acceptCompactEncoding = false;
+
+static const char* responseHeaders[] = {"Content-Type"};
+
+// Open a request. Plain http connects the client to the cached server address
+// so HTTPClient skips its own DNS lookup, the client has to outlive the request.
+// That connect happens here, so it needs the timeout given to http as well.
+bool OtamHttp::begin(HTTPClient& http, WiFiClient& client, const String& url, int32_t connectTimeout) {
+#if OTAM_ENABLE_DNS_CACHE
+    if (OtamDnsCache::isEnabled() && url.startsWith("http://")) {
+        int hostStart = 7;
+        int pathStart = url.indexOf('/', hostStart);
+        String hostPort = url.substring(hostStart, pathStart < 0 ? url.length() : pathStart);
+        int colon = hostPort.indexOf(':');
+        String host = colon < 0 ? hostPort : hostPort.substring(0, colon);
+        uint16_t port = colon < 0 ? 80 : hostPort.substring(colon + 1).toInt();
+
+        IPAddress address;
+        if (OtamDnsCache::resolve(host, address)) {
+            if (client.connect(address, port, connectTimeout)) {
+                return http.begin(client, url);
+            }
+            // The address may have moved, look it up again next time
+            OtamDnsCache::invalidate(host);
+        }
+    }
+#endif
+    return http.begin(url);
+}
+
+void OtamHttp::addHeaders(HTTPClient& http) {
+    http.addHeader("x-api-key", apiKey);
+
+    // Offer CBOR, servers that do not know it keep answering in JSON
+    if (acceptCompactEncoding) {
+        http.addHeader("Accept", "application/cbor, application/json");
+        http.collectHeaders(responseHeaders, 1);
+    }
+}
+
+OtamHttpResponse OtamHttp::readResponse(HTTPClient& http, int httpCode) {
+    String contentType = http.header("Content-Type");
+    OTAM_CAPTURE(
+        response(httpCode, http.getSize(), contentType != "" ? "Content-Type: " + contentType + "\n" : ""));
+
+    OtamHttpResponse response;
+    response.httpCode = httpCode;
+    response.payload = http.getString();
+    response.compact = acceptCompactEncoding && contentType.startsWith("application/cbor");
+
+    OTAM_CAPTURE(body((const uint8_t*)response.payload.c_str(), response.payload.length()));
+    OTAM_CAPTURE(finish());
+
+    // Once the server answers in CBOR the request bodies switch over as well
+    if (response.compact) {
+        OtamPayload::compactEncoding = true;
+    }
+
+    return response;
+}
 
 OtamHttpResponse OtamHttp::get(String url) {
+    OTAM_TRACE("OtamHttp::get");
+    WiFiClient client;
     HTTPClient http;
 
-    http.begin(url);
-    http.addHeader("x-api-key", apiKey);
+    begin(http, client, url);
+    addHeaders(http);
 
+    OTAM_CAPTURE(request("GET", url, nullptr, 0));
     int httpCode = http.GET();
-    String response = http.getString();
+    OtamHttpResponse response = readResponse(http, httpCode);
 
     http.end();
 
-    return {httpCode, response};
+    return response;
 }
 
 OtamHttpResponse OtamHttp::post(String url, String payload) {
+    OTAM_TRACE("OtamHttp::post");
+    WiFiClient client;
     HTTPClient http;
 
-    http.begin(url);
-    http.addHeader("x-api-key", apiKey);
+    begin(http, client, url);
+    addHeaders(http);
     http.addHeader("Content-Type", "application/json");
 
+    OTAM_CAPTURE(request("POST", url, (const uint8_t*)payload.c_str(), payload.length()));
     int httpCode = http.POST(payload);
-    String response = http.getString();
+    OtamHttpResponse response = readResponse(http, httpCode);
 
     http.end();
 
-    return {httpCode, payload: response};
-}
\ No newline at end of file
+    return response;
+}
+
+OtamHttpResponse OtamHttp::post(String url, OtamPayload& payload) {
+    const uint8_t* body = payload.data();
+    return post(url, body, payload.size(), payload.contentType());
+}
+
+OtamHttpResponse OtamHttp::post(String url, const uint8_t* body, size_t size, const char* contentType) {
+    OTAM_TRACE("OtamHttp::post");
+    WiFiClient client;
+    HTTPClient http;
+
+    begin(http, client, url);
+    addHeaders(http);
+    http.addHeader("Content-Type", contentType);
+
+    OTAM_CAPTURE(request("POST", url, body, size));
+    int httpCode = http.POST((uint8_t*)body, size);
+    OtamHttpResponse response = readResponse(http, httpCode);
+
+    http.end();
+
+    return response;
+}
@@ -0,0 +1,304 @@
+#include "internal/OtamPayload.h"
+
+// Set once the server has answered in the compact encoding
+bool OtamPayload::compactEncoding = false;
+
+const char* OtamPayload::fieldName(OtamField field) {
+    switch (field) {
+        case OTAM_FIELD_DEVICE_ID:
+            return "deviceId";
+        case OTAM_FIELD_DEVICE_GUID:
+            return "deviceGuid";
+        case OTAM_FIELD_DEVICE_PROFILE_ID:
+            return "deviceProfileId";
+        case OTAM_FIELD_DEVICE_STATUS:
+            return "deviceStatus";
+        case OTAM_FIELD_FIRMWARE_FILE_ID:
+            return "firmwareFileId";
+        case OTAM_FIELD_FIRMWARE_ID:
+            return "firmwareId";
+        case OTAM_FIELD_FIRMWARE_NAME:
+            return "firmwareName";
+        case OTAM_FIELD_FIRMWARE_VERSION:
+            return "firmwareVersion";
+        case OTAM_FIELD_LOG_MESSAGE:
+            return "logMessage";
+        case OTAM_FIELD_MESSAGE:
+            return "message";
+        case OTAM_FIELD_FIRMWARE_FILE_URL:
+            return "firmwareFileUrl";
+        case OTAM_FIELD_FIRMWARE_FILE_SIZE:
+            return "firmwareFileSize";
+        case OTAM_FIELD_FIRMWARE_FILE_HASH:
+            return "firmwareFileHash";
+        case OTAM_FIELD_FIRMWARE_FILE_URL_EXPIRES_IN:
+            return "firmwareFileUrlExpiresIn";
+        case OTAM_FIELD_FIRMWARE_PEERS:
+            return "firmwarePeers";
+        case OTAM_FIELD_DOWNLOAD_RATE:
+            return "downloadRate";
+        case OTAM_FIELD_DOWNLOAD_RATE_LIMIT:
+            return "downloadRateLimit";
+        case OTAM_FIELD_SEQUENCE:
+            return "sequence";
+        case OTAM_FIELD_FIRMWARE_MIRRORS:
+            return "firmwareMirrors";
+        case OTAM_FIELD_MIRROR_STATS:
+            return "mirrorStats";
+        case OTAM_FIELD_MIRROR_RANK:
+            return "mirrorRank";
+        case OTAM_FIELD_TIME_TO_FIRST_BYTE:
+            return "timeToFirstByte";
+        case OTAM_FIELD_DOWNLOAD_BYTES:
+            return "downloadBytes";
+        case OTAM_FIELD_LOGS:
+            return "logs";
+        case OTAM_FIELD_LOG_ACK:
+            return "logAck";
+        case OTAM_FIELD_FREE_HEAP:
+            return "freeHeap";
+        case OTAM_FIELD_UPTIME:
+            return "uptime";
+        case OTAM_FIELD_RSSI:
+            return "rssi";
+        case OTAM_FIELD_MIN_FREE_HEAP:
+            return "minFreeHeap";
+        case OTAM_FIELD_RESET_REASON:
+            return "resetReason";
+        case OTAM_FIELD_RUNNING_FIRMWARE_FILE_ID:
+            return "runningFirmwareFileId";
+        case OTAM_FIELD_PARTITION:
+            return "partition";
+    }
+    return "";
+}
+
+OtamPayload::OtamPayload() : compact(compactEncoding), cbor(buffer, sizeof(buffer)) {
+    if (compact) {
+        cbor.beginMap();
+    } else {
+        json = "{";
+    }
+}
+
+// Separate a member from the previous one unless it opens the array or object
+void OtamPayload::addJsonSeparator() {
+    char last = json.charAt(json.length() - 1);
+    if (last != '{' && last != '[') {
+        json += ",";
+    }
+}
+
+// Drop a compact member that did not fit whole
+void OtamPayload::keepComplete(size_t mark) {
+    if (!cbor.ok()) {
+        cbor.rollback(mark);
+    }
+}
+
+void OtamPayload::addJsonKey(OtamField field) {
+    addJsonSeparator();
+    json += "\"";
+    json += fieldName(field);
+    json += "\":";
+}
+
+// Quoted JSON string, log messages and names may carry quotes and control characters
+void OtamPayload::addJsonString(const char* value) {
+    json += "\"";
+    for (const char* current = value; *current; current++) {
+        char c = *current;
+        if (c == '"' || c == '\\') {
+            json += '\\';
+            json += c;
+        } else if (c == '\n') {
+            json += "\\n";
+        } else if (c == '\r') {
+            json += "\\r";
+        } else if (c == '\t') {
+            json += "\\t";
+        } else if ((uint8_t)c < 0x20) {
+            char escaped[7];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+            json += escaped;
+        } else {
+            json += c;
+        }
+    }
+    json += "\"";
+}
+
+void OtamPayload::add(OtamField field, const char* value) {
+    if (compact) {
+        if (droppedDepth > 0) {
+            return;
+        }
+        size_t mark = cbor.size();
+        cbor.addInt(field);
+        cbor.addString(value);
+        keepComplete(mark);
+    } else {
+        addJsonKey(field);
+        addJsonString(value);
+    }
+}
+
+void OtamPayload::add(OtamField field, const String& value) {
+    add(field, value.c_str());
+}
+
+void OtamPayload::add(OtamField field, int value) {
+    if (compact) {
+        if (droppedDepth > 0) {
+            return;
+        }
+        size_t mark = cbor.size();
+        cbor.addInt(field);
+        cbor.addInt(value);
+        keepComplete(mark);
+    } else {
+        addJsonKey(field);
+        json += value;
+    }
+}
+
+// Open an array member, close it with end
+void OtamPayload::beginArray(OtamField field) {
+    if (compact) {
+        size_t mark = cbor.size();
+        if (droppedDepth == 0) {
+            cbor.addInt(field);
+            cbor.beginArray();
+            keepComplete(mark);
+        }
+        if (droppedDepth > 0 || cbor.size() == mark) {
+            // Its members and end are skipped as well
+            droppedDepth++;
+            return;
+        }
+    } else {
+        addJsonKey(field);
+        json += "[";
+    }
+    arrayMask |= 1 << depth;
+    depth++;
+}
+
+// Open an object inside an array, close it with end
+void OtamPayload::beginObject() {
+    if (compact) {
+        size_t mark = cbor.size();
+        if (droppedDepth == 0) {
+            cbor.beginMap();
+            keepComplete(mark);
+        }
+        if (droppedDepth > 0 || cbor.size() == mark) {
+            droppedDepth++;
+            return;
+        }
+    } else {
+        addJsonSeparator();
+        json += "{";
+    }
+    arrayMask &= ~(1 << depth);
+    depth++;
+}
+
+// Add a string to the open array
+void OtamPayload::addItem(const String& value) {
+    if (compact) {
+        if (droppedDepth > 0) {
+            return;
+        }
+        size_t mark = cbor.size();
+        cbor.addString(value.c_str());
+        keepComplete(mark);
+    } else {
+        addJsonSeparator();
+        addJsonString(value.c_str());
+    }
+}
+
+void OtamPayload::end() {
+    if (droppedDepth > 0) {
+        droppedDepth--;
+        return;
+    }
+    if (depth == 0) {
+        return;
+    }
+    depth--;
+    if (compact) {
+        cbor.end();
+    } else {
+        json += (arrayMask & (1 << depth)) ? "]" : "}";
+    }
+}
+
+bool OtamPayload::isCompact() const {
+    return compact;
+}
+
+// Room left in the compact buffer, JSON bodies grow as needed
+size_t OtamPayload::remaining() const {
+    return compact ? cbor.remaining() : SIZE_MAX;
+}
+
+const char* OtamPayload::contentType() const {
+    return compact ? "application/cbor" : "application/json";
+}
+
+// Close the document and return the encoded bytes
+const uint8_t* OtamPayload::data() {
+    if (!finished) {
+        while (depth > 0) {
+            end();
+        }
+        finished = true;
+        if (compact) {
+            cbor.end();
+        } else {
+            json += "}";
+        }
+    }
+    return compact ? buffer : (const uint8_t*)json.c_str();
+}
+
+size_t OtamPayload::size() {
+    data();
+    return compact ? cbor.size() : json.length();
+}
+
+OtamPayloadReader::OtamPayloadReader(const String& body, bool compact) : body(body), compact(compact) {}
+
+String OtamPayloadReader::getValue(OtamField field) {
+    if (compact) {
+        return LightCbor::getValue((const uint8_t*)body.c_str(), body.length(), field,
+                                   OtamPayload::fieldName(field));
+    }
+    return LightJson::getValue(body.c_str(), OtamPayload::fieldName(field));
+}
+
+int OtamPayloadReader::getIntValue(OtamField field) {
+    if (compact) {
+        return LightCbor::getIntValue((const uint8_t*)body.c_str(), body.length(), field,
+                                      OtamPayload::fieldName(field));
+    }
+    return LightJson::getIntValue(body.c_str(), OtamPayload::fieldName(field));
+}
+
+bool OtamPayloadReader::hasKey(OtamField field) {
+    if (compact) {
+        return LightCbor::hasKey((const uint8_t*)body.c_str(), body.length(), field,
+                                 OtamPayload::fieldName(field));
+    }
+    return LightJson::hasKey(body.c_str(), OtamPayload::fieldName(field));
+}
+
+String OtamPayloadReader::getArrayItem(OtamField field, int index) {
+    if (compact) {
+        return LightCbor::getArrayItem((const uint8_t*)body.c_str(), body.length(), field,
+                                       OtamPayload::fieldName(field), index);
+    }
+    return LightJson::getArrayItem(body.c_str(), OtamPayload::fieldName(field), index);
+}
@@ -0,0 +1,128 @@
+#include "internal/OtamFeatures.h"
+
+#if OTAM_ENABLE_PEERS
+#include "internal/OtamPeerServer.h"
+
+const char* OtamPeerServer::firmwarePath = "/otam/firmware/";
+
+// Size of the buffer used to move the image from flash to the socket
+const size_t PEER_BUFFER_SIZE = 1024;
+
+OtamPeerServer::~OtamPeerServer() {
+    stop();
+}
+
+// Start serving the verified firmware image to LAN peers
+bool OtamPeerServer::begin(uint16_t port, bool advertise, String hostName) {
+    if (server) {
+        return true;
+    }
+
+    serverPort = port;
+    server = new WebServer(port);
+    server->onNotFound([this]() { handleFirmwareRequest(); });
+    server->begin();
+
+    OTAM_LOG("OTAM: Peer firmware server listening on port " + String(port));
+
+    // Let neighbours find this device without a peer list from the server
+    if (advertise) {
+        if (MDNS.begin(hostName.c_str())) {
+            mdnsStarted = true;
+            MDNS.addService("otam", "tcp", port);
+            advertiseFirmware(OtamStore::readPeerFileIdFromStore());
+        } else {
+            OTAM_LOG("OTAM: mDNS responder failed to start");
+        }
+    }
+
+    return true;
+}
+
+// Publish the firmware file id this device can serve
+void OtamPeerServer::advertiseFirmware(int firmwareFileId) {
+    if (mdnsStarted) {
+        MDNS.addServiceTxt("otam", "tcp", "fileId", String(firmwareFileId).c_str());
+    }
+}
+
+// Process pending peer requests, call from the application loop
+void OtamPeerServer::handle() {
+    if (server) {
+        server->handleClient();
+    }
+}
+
+void OtamPeerServer::stop() {
+    if (server) {
+        server->stop();
+        delete server;
+        server = nullptr;
+    }
+    if (mdnsStarted) {
+        MDNS.end();
+        mdnsStarted = false;
+    }
+}
+
+// Serve GET /otam/firmware/<firmwareFileId> from the partition holding the verified image
+void OtamPeerServer::handleFirmwareRequest() {
+    String uri = server->uri();
+    if (!uri.startsWith(firmwarePath)) {
+        server->send(404, "text/plain", "Not found");
+        return;
+    }
+
+    int firmwareFileId = uri.substring(strlen(firmwarePath)).toInt();
+    int peerFileId = OtamStore::readPeerFileIdFromStore();
+    if (firmwareFileId <= 0 || firmwareFileId != peerFileId) {
+        server->send(404, "text/plain", "Firmware not available");
+        return;
+    }
+
+    String partitionLabel = OtamStore::readPeerPartitionFromStore();
+    int fileSize = OtamStore::readPeerFileSizeFromStore();
+    const esp_partition_t* partition =
+        esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_ANY, partitionLabel.c_str());
+    if (!partition || fileSize <= 0 || (uint32_t)fileSize > partition->size) {
+        server->send(404, "text/plain", "Firmware not available");
+        return;
+    }
+
+    OTAM_LOG("OTAM: Serving firmware file " + String(firmwareFileId) + " to peer");
+
+    // Headers first, the body is streamed straight from flash
+    server->setContentLength(fileSize);
+    server->sendHeader("x-firmware-hash", OtamStore::readPeerFileHashFromStore());
+    server->send(200, "application/octet-stream", "");
+
+    WiFiClient client = server->client();
+    uint8_t buffer[PEER_BUFFER_SIZE];
+    size_t sent = 0;
+    while (sent < (size_t)fileSize && client.connected()) {
+        size_t chunk = min(PEER_BUFFER_SIZE, (size_t)fileSize - sent);
+        if (esp_partition_read(partition, sent, buffer, chunk) != ESP_OK) {
+            OTAM_LOG("OTAM: Reading firmware partition for peer failed");
+            break;
+        }
+        if (client.write(buffer, chunk) != chunk) {
+            break;
+        }
+        sent += chunk;
+    }
+}
+
+// Find LAN peers advertising the firmware file over mDNS, returns the number of urls written
+int OtamPeerServer::discoverPeers(int firmwareFileId, String* peerUrls, int maxPeers) {
+    int peerCount = 0;
+    int serviceCount = MDNS.queryService("otam", "tcp");
+    for (int i = 0; i < serviceCount && peerCount < maxPeers; i++) {
+        if (MDNS.txt(i, "fileId").toInt() != firmwareFileId) {
+            continue;
+        }
+        peerUrls[peerCount++] = "http://" + MDNS.IP(i).toString() + ":" + String(MDNS.port(i));
+    }
+    return peerCount;
+}
+
+#endif  // OTAM_ENABLE_PEERS
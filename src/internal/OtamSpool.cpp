@@ -0,0 +1,241 @@
+#include "internal/OtamSpool.h"
+
+#if OTAM_ENABLE_SPOOL
+
+// Entry layout: compact flag, url length, url, encoded payload
+const size_t SPOOL_ENTRY_HEADER_SIZE = 2;
+
+// Sequence numbers are reserved in NVS this many at a time, numbers left over
+// at a reboot are skipped
+const uint32_t SPOOL_SEQUENCE_BLOCK = 64;
+
+// Transport errors and server errors are retried, other responses are final
+static bool isDelivered(int httpCode) {
+    return httpCode > 0 && httpCode < 500;
+}
+
+void OtamSpool::begin(int spoolCapacity, int spoolReplayBatch, unsigned long spoolReplayInterval) {
+    capacity = spoolCapacity;
+    replayBatch = spoolReplayBatch > 0 ? spoolReplayBatch : 1;
+    replayInterval = spoolReplayInterval;
+
+    if (capacity <= 0) {
+        return;
+    }
+
+    Preferences preferences;
+    if (!preferences.begin("otam-spool", false)) {
+        OTAM_LOG("Error: Failed to initialize NVS in OtamSpool::begin");
+        capacity = 0;
+        return;
+    }
+
+    sequence = preferences.getUInt("seq", 0);
+    sequenceLimit = sequence;
+    head = preferences.getUInt("head", 0);
+    tail = preferences.getUInt("tail", 0);
+
+    // Entries are keyed by their index modulo the capacity they were written with,
+    // under a different capacity the keys no longer match and the entries are dropped
+    uint32_t spooledCapacity = preferences.getUInt("cap", capacity);
+    if (spooledCapacity != (uint32_t)capacity) {
+        if (tail != head) {
+            OTAM_LOG("OTAM: Spool capacity changed, dropped " + String(tail - head) + " spooled reports");
+        }
+        for (uint32_t index = head; index != tail && index - head < spooledCapacity; index++) {
+            preferences.remove(("r" + String(index % spooledCapacity)).c_str());
+        }
+        head = tail;
+        preferences.putUInt("head", head);
+    }
+    if (spooledCapacity != (uint32_t)capacity || !preferences.isKey("cap")) {
+        preferences.putUInt("cap", capacity);
+    }
+    preferences.end();
+
+    if (tail != head) {
+        OTAM_LOG("OTAM: " + String(tail - head) + " spooled reports waiting for replay");
+    }
+}
+
+bool OtamSpool::isEnabled() {
+    return capacity > 0;
+}
+
+String OtamSpool::entryKey(uint32_t index) {
+    return "r" + String(index % capacity);
+}
+
+int OtamSpool::size() {
+    return capacity > 0 ? (int)(tail - head) : 0;
+}
+
+// Keep an undelivered report, the oldest one is overwritten when the ring is full
+void OtamSpool::append(const String& url, OtamPayload& payload) {
+    size_t payloadSize = payload.size();
+    size_t entrySize = SPOOL_ENTRY_HEADER_SIZE + url.length() + payloadSize;
+    if (url.length() > 255 || entrySize > OTAM_SPOOL_MAX_ENTRY_SIZE) {
+        OTAM_LOG("OTAM: Report too large for the spool, dropped");
+        return;
+    }
+
+    uint8_t entry[OTAM_SPOOL_MAX_ENTRY_SIZE];
+    entry[0] = payload.isCompact() ? 1 : 0;
+    entry[1] = (uint8_t)url.length();
+    memcpy(entry + SPOOL_ENTRY_HEADER_SIZE, url.c_str(), url.length());
+    memcpy(entry + SPOOL_ENTRY_HEADER_SIZE + url.length(), payload.data(), payloadSize);
+
+    Preferences preferences;
+    if (!preferences.begin("otam-spool", false)) {
+        OTAM_LOG("Error: Failed to initialize NVS in OtamSpool::append");
+        return;
+    }
+
+    if (!preferences.putBytes(entryKey(tail).c_str(), entry, entrySize)) {
+        OTAM_LOG("Error: Failed to write spooled report to NVS");
+        preferences.end();
+        return;
+    }
+
+    tail++;
+    preferences.putUInt("tail", tail);
+
+    if (tail - head > (uint32_t)capacity) {
+        OTAM_LOG("OTAM: Spool full, dropped the oldest report");
+        head = tail - capacity;
+        preferences.putUInt("head", head);
+    }
+
+    preferences.end();
+}
+
+// Take the next sequence number, persisting a new block when the reserved one runs out
+bool OtamSpool::nextSequence(uint32_t& number) {
+    if (sequence >= sequenceLimit) {
+        Preferences preferences;
+        if (!preferences.begin("otam-spool", false)) {
+            OTAM_LOG("Error: Failed to initialize NVS in OtamSpool::nextSequence");
+            return false;
+        }
+        sequenceLimit = sequence + SPOOL_SEQUENCE_BLOCK;
+        preferences.putUInt("seq", sequenceLimit);
+        preferences.end();
+    }
+
+    number = sequence++;
+    return true;
+}
+
+// Send a report, undelivered reports are spooled and replayed later. While the
+// link is down reports go straight to the spool and replay probes the link.
+OtamHttpResponse OtamSpool::post(String url, OtamPayload& payload) {
+    if (capacity <= 0) {
+        return OtamHttp::post(url, payload);
+    }
+
+    // Number the report before the first attempt so the server can recognise
+    // a replay of a report it did receive
+    uint32_t number;
+    if (!nextSequence(number)) {
+        return OtamHttp::post(url, payload);
+    }
+    payload.add(OTAM_FIELD_SEQUENCE, (int)number);
+
+    if (linkDown) {
+        append(url, payload);
+        replay();
+
+        OtamHttpResponse response;
+        response.httpCode = HTTPC_ERROR_NOT_CONNECTED;
+        response.compact = false;
+        return response;
+    }
+
+    OtamHttpResponse response = OtamHttp::post(url, payload);
+
+    if (!isDelivered(response.httpCode)) {
+        OTAM_LOG("OTAM: Report not delivered (" + String(response.httpCode) + "), spooled");
+        append(url, payload);
+
+        // The first probe waits a full replay interval
+        linkDown = true;
+        replayed = true;
+        lastReplayAt = millis();
+        return response;
+    }
+
+    // The link is up, send what was spooled while it was down
+    replay();
+
+    return response;
+}
+
+// Send up to replayBatch spooled reports, at most once per replayInterval.
+// Returns the number of reports delivered.
+int OtamSpool::replay() {
+    if (size() == 0) {
+        // Nothing to probe with, the next report is sent live
+        linkDown = false;
+        return 0;
+    }
+
+    if (replayed && millis() - lastReplayAt < replayInterval) {
+        return 0;
+    }
+    replayed = true;
+    lastReplayAt = millis();
+
+    Preferences preferences;
+    if (!preferences.begin("otam-spool", false)) {
+        OTAM_LOG("Error: Failed to initialize NVS in OtamSpool::replay");
+        return 0;
+    }
+
+    uint8_t entry[OTAM_SPOOL_MAX_ENTRY_SIZE];
+    int delivered = 0;
+
+    while (head != tail && delivered < replayBatch) {
+        String key = entryKey(head);
+        size_t entrySize = preferences.getBytesLength(key.c_str());
+
+        // Skip entries that can not be read back
+        if (entrySize < SPOOL_ENTRY_HEADER_SIZE || entrySize > sizeof(entry) ||
+            preferences.getBytes(key.c_str(), entry, entrySize) != entrySize ||
+            SPOOL_ENTRY_HEADER_SIZE + entry[1] > entrySize) {
+            preferences.remove(key.c_str());
+            head++;
+            continue;
+        }
+
+        size_t urlLength = entry[1];
+        String url;
+        url.concat((const char*)entry + SPOOL_ENTRY_HEADER_SIZE, urlLength);
+        const uint8_t* body = entry + SPOOL_ENTRY_HEADER_SIZE + urlLength;
+        size_t bodySize = entrySize - SPOOL_ENTRY_HEADER_SIZE - urlLength;
+
+        OtamHttpResponse response =
+            OtamHttp::post(url, body, bodySize, entry[0] ? "application/cbor" : "application/json");
+
+        // Still offline, keep the rest for the next attempt
+        if (!isDelivered(response.httpCode)) {
+            linkDown = true;
+            break;
+        }
+
+        linkDown = false;
+        preferences.remove(key.c_str());
+        head++;
+        delivered++;
+    }
+
+    preferences.putUInt("head", head);
+    preferences.end();
+
+    if (delivered > 0) {
+        OTAM_LOG("OTAM: Replayed " + String(delivered) + " spooled reports");
+    }
+
+    return delivered;
+}
+
+#endif
@@ -1,9 +1,11 @@
 #include "internal/OtamStore.h"
+#include "internal/OtamTrace.h"
 
 String OtamStore::readDeviceGuidFromStore() {
+    OTAM_TRACE("OtamStore::readDeviceGuidFromStore");
     Preferences preferences;
     if (!preferences.begin("otam-store", false)) {
-        Serial.println("Error: Failed to initialize NVS in readDeviceGuidFromStore");
+        OTAM_LOG("Error: Failed to initialize NVS in readDeviceGuidFromStore");
         return "";
     }
 
@@ -18,22 +20,23 @@ String OtamStore::readDeviceGuidFromStore() {
 }
 
 void OtamStore::writeDeviceGuidToStore(String deviceGuid) {
+    OTAM_TRACE("OtamStore::writeDeviceGuidToStore");
     Preferences preferences;
     if (!preferences.begin("otam-store", false)) {
-        Serial.println("Error: Failed to initialize NVS in writeDeviceGuidToStore");
+        OTAM_LOG("Error: Failed to initialize NVS in writeDeviceGuidToStore");
         return;
     }
 
     if (deviceGuid.length() == 0) {
         if (preferences.getString("device_guid", "").length() > 0) {
             if (!preferences.remove("device_guid")) {
-                Serial.println("Error: Failed to remove device ID from NVS");
+                OTAM_LOG("Error: Failed to remove device ID from NVS");
                 preferences.end();
                 return;
             }
         }
     } else if (!preferences.putString("device_guid", deviceGuid)) {
-        Serial.println("Error: Failed to write device ID to NVS");
+        OTAM_LOG("Error: Failed to write device ID to NVS");
         preferences.end();
         return;
     }
@@ -42,9 +45,10 @@ void OtamStore::writeDeviceGuidToStore(String deviceGuid) {
 }
 
 int OtamStore::readFirmwareUpdateFileIdFromStore() {
+    OTAM_TRACE("OtamStore::readFirmwareUpdateFileIdFromStore");
     Preferences preferences;
     if (!preferences.begin("otam-store", false)) {
-        Serial.println("Error: Failed to initialize NVS in readFirmwareUpdateFileIdFromStore");
+        OTAM_LOG("Error: Failed to initialize NVS in readFirmwareUpdateFileIdFromStore");
         return 0;
     }
 
@@ -54,23 +58,25 @@ int OtamStore::readFirmwareUpdateFileIdFromStore() {
 }
 
 void OtamStore::writeFirmwareUpdateFileIdToStore(int firmwareUpdateFileId) {
+    OTAM_TRACE("OtamStore::writeFirmwareUpdateFileIdToStore");
     Preferences preferences;
     if (!preferences.begin("otam-store", false)) {
-        Serial.println("Error: Failed to initialize NVS in writeFirmwareUpdateFileIdToStore");
+        OTAM_LOG("Error: Failed to initialize NVS in writeFirmwareUpdateFileIdToStore");
         return;
     }
 
     if (preferences.putInt("file_id", firmwareUpdateFileId) == 0) {
-        Serial.println("Error: Failed to write firmware file update ID to NVS");
+        OTAM_LOG("Error: Failed to write firmware file update ID to NVS");
     }
 
     preferences.end();
 }
 
 int OtamStore::readFirmwareUpdateIdFromStore() {
+    OTAM_TRACE("OtamStore::readFirmwareUpdateIdFromStore");
     Preferences preferences;
     if (!preferences.begin("otam-store", false)) {
-        Serial.println("Error: Failed to initialize NVS in readFirmwareUpdateIdFromStore");
+        OTAM_LOG("Error: Failed to initialize NVS in readFirmwareUpdateIdFromStore");
         return 0;
     }
 
@@ -80,23 +86,26 @@ int OtamStore::readFirmwareUpdateIdFromStore() {
 }
 
 void OtamStore::writeFirmwareUpdateIdToStore(int firmwareUpdateId) {
+    OTAM_TRACE("OtamStore::writeFirmwareUpdateIdToStore");
     Preferences preferences;
     if (!preferences.begin("otam-store", false)) {
-        Serial.println("Error: Failed to initialize NVS in writeFirmwareUpdateIdToStore");
+        OTAM_LOG("Error: Failed to initialize NVS in writeFirmwareUpdateIdToStore");
         return;
     }
 
     if (preferences.putInt("firmware_id", firmwareUpdateId) == 0) {
-        Serial.println("Error: Failed to write firmware update ID to NVS");
+        OTAM_LOG("Error: Failed to write firmware update ID to NVS");
     }
 
     preferences.end();
 }
 
+#if OTAM_ENABLE_FIRMWARE_STRINGS
 String OtamStore::readFirmwareUpdateNameFromStore() {
+    OTAM_TRACE("OtamStore::readFirmwareUpdateNameFromStore");
     Preferences preferences;
     if (!preferences.begin("otam-store", false)) {
-        Serial.println("Error: Failed to initialize NVS in readFirmwareUpdateNameFromStore");
+        OTAM_LOG("Error: Failed to initialize NVS in readFirmwareUpdateNameFromStore");
         return "";
     }
 
@@ -111,14 +120,15 @@ String OtamStore::readFirmwareUpdateNameFromStore() {
 }
 
 void OtamStore::writeFirmwareUpdateNameToStore(String firmwareUpdateName) {
+    OTAM_TRACE("OtamStore::writeFirmwareUpdateNameToStore");
     Preferences preferences;
     if (!preferences.begin("otam-store", false)) {
-        Serial.println("Error: Failed to initialize NVS in writeFirmwareUpdateNameToStore");
+        OTAM_LOG("Error: Failed to initialize NVS in writeFirmwareUpdateNameToStore");
         return;
     }
 
     if (!preferences.putString("firmware_name", firmwareUpdateName)) {
-        Serial.println("Error: Failed to write firmware update name to NVS");
+        OTAM_LOG("Error: Failed to write firmware update name to NVS");
         preferences.end();
         return;
     }
@@ -127,9 +137,10 @@ void OtamStore::writeFirmwareUpdateNameToStore(String firmwareUpdateName) {
 }
 
 String OtamStore::readFirmwareUpdateVersionFromStore() {
+    OTAM_TRACE("OtamStore::readFirmwareUpdateVersionFromStore");
     Preferences preferences;
     if (!preferences.begin("otam-store", false)) {
-        Serial.println("Error: Failed to initialize NVS in readFirmwareUpdateVersionFromStore");
+        OTAM_LOG("Error: Failed to initialize NVS in readFirmwareUpdateVersionFromStore");
         return "";
     }
 
@@ -144,25 +155,28 @@ String OtamStore::readFirmwareUpdateVersionFromStore() {
 }
 
 void OtamStore::writeFirmwareUpdateVersionToStore(String firmwareUpdateVersion) {
+    OTAM_TRACE("OtamStore::writeFirmwareUpdateVersionToStore");
     Preferences preferences;
     if (!preferences.begin("otam-store", false)) {
-        Serial.println("Error: Failed to initialize NVS in writeFirmwareUpdateVersionToStore");
+        OTAM_LOG("Error: Failed to initialize NVS in writeFirmwareUpdateVersionToStore");
         return;
     }
 
     if (!preferences.putString("fw_version", firmwareUpdateVersion)) {
-        Serial.println("Error: Failed to write firmware update version to NVS");
+        OTAM_LOG("Error: Failed to write firmware update version to NVS");
         preferences.end();
         return;
     }
 
     preferences.end();
 }
+#endif
 
 String OtamStore::readFirmwareUpdateStatusFromStore() {
+    OTAM_TRACE("OtamStore::readFirmwareUpdateStatusFromStore");
     Preferences preferences;
     if (!preferences.begin("otam-store", false)) {
-        Serial.println("Error: Failed to initialize NVS in readFirmwareUpdateStatusFromStore");
+        OTAM_LOG("Error: Failed to initialize NVS in readFirmwareUpdateStatusFromStore");
         return "";
     }
 
@@ -177,18 +191,343 @@ String OtamStore::readFirmwareUpdateStatusFromStore() {
 }
 
 void OtamStore::writeFirmwareUpdateStatusToStore(String firmwareUpdateStatus) {
+    OTAM_TRACE("OtamStore::writeFirmwareUpdateStatusToStore");
     Preferences preferences;
 
     if (!preferences.begin("otam-store", false)) {
-        Serial.println("Error: Failed to initialize NVS in writeFirmwareUpdateStatusToStore");
+        OTAM_LOG("Error: Failed to initialize NVS in writeFirmwareUpdateStatusToStore");
         return;
     }
 
     if (!preferences.putString("fw_status", firmwareUpdateStatus)) {
-        Serial.println("Error: Failed to write firmware update status to NVS");
+        OTAM_LOG("Error: Failed to write firmware update status to NVS");
         preferences.end();
         return;
     }
 
+    preferences.end();
+}
+
+String OtamStore::readStagedPartitionFromStore() {
+    OTAM_TRACE("OtamStore::readStagedPartitionFromStore");
+    Preferences preferences;
+    if (!preferences.begin("otam-store", false)) {
+        OTAM_LOG("Error: Failed to initialize NVS in readStagedPartitionFromStore");
+        return "";
+    }
+
+    String stagedPartition;
+
+    if (preferences.isKey("staged_part")) {
+        // Label of the partition holding a staged image
+        stagedPartition = preferences.getString("staged_part");
+    }
+
+    preferences.end();
+    return stagedPartition;
+}
+
+void OtamStore::writeStagedPartitionToStore(String stagedPartition) {
+    OTAM_TRACE("OtamStore::writeStagedPartitionToStore");
+    Preferences preferences;
+    if (!preferences.begin("otam-store", false)) {
+        OTAM_LOG("Error: Failed to initialize NVS in writeStagedPartitionToStore");
+        return;
+    }
+
+    if (stagedPartition.length() == 0) {
+        if (preferences.isKey("staged_part") && !preferences.remove("staged_part")) {
+            OTAM_LOG("Error: Failed to remove staged partition from NVS");
+        }
+    } else if (!preferences.putString("staged_part", stagedPartition)) {
+        OTAM_LOG("Error: Failed to write staged partition to NVS");
+    }
+
+    preferences.end();
+}
+
+String OtamStore::readPreviousPartitionFromStore() {
+    OTAM_TRACE("OtamStore::readPreviousPartitionFromStore");
+    Preferences preferences;
+    if (!preferences.begin("otam-store", false)) {
+        OTAM_LOG("Error: Failed to initialize NVS in readPreviousPartitionFromStore");
+        return "";
+    }
+
+    String previousPartition;
+
+    if (preferences.isKey("prev_part")) {
+        previousPartition = preferences.getString("prev_part");  // Partition to revert to if unconfirmed
+    }
+
+    preferences.end();
+    return previousPartition;
+}
+
+void OtamStore::writePreviousPartitionToStore(String previousPartition) {
+    OTAM_TRACE("OtamStore::writePreviousPartitionToStore");
+    Preferences preferences;
+    if (!preferences.begin("otam-store", false)) {
+        OTAM_LOG("Error: Failed to initialize NVS in writePreviousPartitionToStore");
+        return;
+    }
+
+    if (previousPartition.length() == 0) {
+        if (preferences.isKey("prev_part") && !preferences.remove("prev_part")) {
+            OTAM_LOG("Error: Failed to remove previous partition from NVS");
+        }
+    } else if (!preferences.putString("prev_part", previousPartition)) {
+        OTAM_LOG("Error: Failed to write previous partition to NVS");
+    }
+
+    preferences.end();
+}
+
+int OtamStore::readVerifyBootCountFromStore() {
+    OTAM_TRACE("OtamStore::readVerifyBootCountFromStore");
+    Preferences preferences;
+    if (!preferences.begin("otam-store", false)) {
+        OTAM_LOG("Error: Failed to initialize NVS in readVerifyBootCountFromStore");
+        return 0;
+    }
+
+    int verifyBootCount = preferences.getInt("verify_boots");
+    preferences.end();
+    return verifyBootCount;
+}
+
+void OtamStore::writeVerifyBootCountToStore(int verifyBootCount) {
+    OTAM_TRACE("OtamStore::writeVerifyBootCountToStore");
+    Preferences preferences;
+    if (!preferences.begin("otam-store", false)) {
+        OTAM_LOG("Error: Failed to initialize NVS in writeVerifyBootCountToStore");
+        return;
+    }
+
+    if (preferences.putInt("verify_boots", verifyBootCount) == 0) {
+        OTAM_LOG("Error: Failed to write verify boot count to NVS");
+    }
+
+    preferences.end();
+}
+
+String OtamStore::readRollbackReasonFromStore() {
+    OTAM_TRACE("OtamStore::readRollbackReasonFromStore");
+    Preferences preferences;
+    if (!preferences.begin("otam-store", false)) {
+        OTAM_LOG("Error: Failed to initialize NVS in readRollbackReasonFromStore");
+        return "";
+    }
+
+    String rollbackReason;
+
+    if (preferences.isKey("rollback_why")) {
+        rollbackReason = preferences.getString("rollback_why");  // Why the last update was reverted
+    }
+
+    preferences.end();
+    return rollbackReason;
+}
+
+void OtamStore::writeRollbackReasonToStore(String rollbackReason) {
+    OTAM_TRACE("OtamStore::writeRollbackReasonToStore");
+    Preferences preferences;
+    if (!preferences.begin("otam-store", false)) {
+        OTAM_LOG("Error: Failed to initialize NVS in writeRollbackReasonToStore");
+        return;
+    }
+
+    if (!preferences.putString("rollback_why", rollbackReason)) {
+        OTAM_LOG("Error: Failed to write rollback reason to NVS");
+    }
+
+    preferences.end();
+}
+
+int OtamStore::readPeerFileIdFromStore() {
+    OTAM_TRACE("OtamStore::readPeerFileIdFromStore");
+    Preferences preferences;
+    if (!preferences.begin("otam-store", false)) {
+        OTAM_LOG("Error: Failed to initialize NVS in readPeerFileIdFromStore");
+        return 0;
+    }
+
+    int peerFileId = preferences.getInt("peer_file_id");
+    preferences.end();
+    return peerFileId;
+}
+
+void OtamStore::writePeerFileIdToStore(int peerFileId) {
+    OTAM_TRACE("OtamStore::writePeerFileIdToStore");
+    Preferences preferences;
+    if (!preferences.begin("otam-store", false)) {
+        OTAM_LOG("Error: Failed to initialize NVS in writePeerFileIdToStore");
+        return;
+    }
+
+    if (preferences.putInt("peer_file_id", peerFileId) == 0) {
+        OTAM_LOG("Error: Failed to write peer firmware file ID to NVS");
+    }
+
+    preferences.end();
+}
+
+String OtamStore::readPeerPartitionFromStore() {
+    OTAM_TRACE("OtamStore::readPeerPartitionFromStore");
+    Preferences preferences;
+    if (!preferences.begin("otam-store", false)) {
+        OTAM_LOG("Error: Failed to initialize NVS in readPeerPartitionFromStore");
+        return "";
+    }
+
+    String peerPartition;
+
+    if (preferences.isKey("peer_part")) {
+        peerPartition = preferences.getString("peer_part");  // Partition holding the image served to peers
+    }
+
+    preferences.end();
+    return peerPartition;
+}
+
+void OtamStore::writePeerPartitionToStore(String peerPartition) {
+    OTAM_TRACE("OtamStore::writePeerPartitionToStore");
+    Preferences preferences;
+    if (!preferences.begin("otam-store", false)) {
+        OTAM_LOG("Error: Failed to initialize NVS in writePeerPartitionToStore");
+        return;
+    }
+
+    if (peerPartition.length() == 0) {
+        if (preferences.isKey("peer_part") && !preferences.remove("peer_part")) {
+            OTAM_LOG("Error: Failed to remove peer partition from NVS");
+        }
+    } else if (!preferences.putString("peer_part", peerPartition)) {
+        OTAM_LOG("Error: Failed to write peer partition to NVS");
+    }
+
+    preferences.end();
+}
+
+int OtamStore::readPeerFileSizeFromStore() {
+    OTAM_TRACE("OtamStore::readPeerFileSizeFromStore");
+    Preferences preferences;
+    if (!preferences.begin("otam-store", false)) {
+        OTAM_LOG("Error: Failed to initialize NVS in readPeerFileSizeFromStore");
+        return 0;
+    }
+
+    int peerFileSize = preferences.getInt("peer_size");
+    preferences.end();
+    return peerFileSize;
+}
+
+void OtamStore::writePeerFileSizeToStore(int peerFileSize) {
+    OTAM_TRACE("OtamStore::writePeerFileSizeToStore");
+    Preferences preferences;
+    if (!preferences.begin("otam-store", false)) {
+        OTAM_LOG("Error: Failed to initialize NVS in writePeerFileSizeToStore");
+        return;
+    }
+
+    if (preferences.putInt("peer_size", peerFileSize) == 0) {
+        OTAM_LOG("Error: Failed to write peer firmware file size to NVS");
+    }
+
+    preferences.end();
+}
+
+String OtamStore::readPeerFileHashFromStore() {
+    OTAM_TRACE("OtamStore::readPeerFileHashFromStore");
+    Preferences preferences;
+    if (!preferences.begin("otam-store", false)) {
+        OTAM_LOG("Error: Failed to initialize NVS in readPeerFileHashFromStore");
+        return "";
+    }
+
+    String peerFileHash;
+
+    if (preferences.isKey("peer_hash")) {
+        peerFileHash = preferences.getString("peer_hash");  // MD5 the served image was verified against
+    }
+
+    preferences.end();
+    return peerFileHash;
+}
+
+void OtamStore::writePeerFileHashToStore(String peerFileHash) {
+    OTAM_TRACE("OtamStore::writePeerFileHashToStore");
+    Preferences preferences;
+    if (!preferences.begin("otam-store", false)) {
+        OTAM_LOG("Error: Failed to initialize NVS in writePeerFileHashToStore");
+        return;
+    }
+
+    if (peerFileHash.length() == 0) {
+        if (preferences.isKey("peer_hash") && !preferences.remove("peer_hash")) {
+            OTAM_LOG("Error: Failed to remove peer firmware file hash from NVS");
+        }
+    } else if (!preferences.putString("peer_hash", peerFileHash)) {
+        OTAM_LOG("Error: Failed to write peer firmware file hash to NVS");
+    }
+
+    preferences.end();
+}
+
+int OtamStore::readRunningFileIdFromStore() {
+    OTAM_TRACE("OtamStore::readRunningFileIdFromStore");
+    Preferences preferences;
+    if (!preferences.begin("otam-store", false)) {
+        OTAM_LOG("Error: Failed to initialize NVS in readRunningFileIdFromStore");
+        return 0;
+    }
+
+    int runningFileId = preferences.getInt("running_file");
+    preferences.end();
+    return runningFileId;
+}
+
+void OtamStore::writeRunningFileIdToStore(int runningFileId) {
+    OTAM_TRACE("OtamStore::writeRunningFileIdToStore");
+    Preferences preferences;
+    if (!preferences.begin("otam-store", false)) {
+        OTAM_LOG("Error: Failed to initialize NVS in writeRunningFileIdToStore");
+        return;
+    }
+
+    if (preferences.putInt("running_file", runningFileId) == 0) {
+        OTAM_LOG("Error: Failed to write running firmware file ID to NVS");
+    }
+
+    preferences.end();
+}
+
+// Blob of the given size, false if it is missing or was stored with another size
+bool OtamStore::readUpdateStatsFromStore(void* updateStats, size_t size) {
+    OTAM_TRACE("OtamStore::readUpdateStatsFromStore");
+    Preferences preferences;
+    if (!preferences.begin("otam-store", false)) {
+        OTAM_LOG("Error: Failed to initialize NVS in readUpdateStatsFromStore");
+        return false;
+    }
+
+    bool found = preferences.isKey("update_stats") && preferences.getBytesLength("update_stats") == size &&
+                 preferences.getBytes("update_stats", updateStats, size) == size;
+    preferences.end();
+    return found;
+}
+
+void OtamStore::writeUpdateStatsToStore(const void* updateStats, size_t size) {
+    OTAM_TRACE("OtamStore::writeUpdateStatsToStore");
+    Preferences preferences;
+    if (!preferences.begin("otam-store", false)) {
+        OTAM_LOG("Error: Failed to initialize NVS in writeUpdateStatsToStore");
+        return;
+    }
+
+    if (preferences.putBytes("update_stats", updateStats, size) != size) {
+        OTAM_LOG("Error: Failed to write update statistics to NVS");
+    }
+
     preferences.end();
 }
\ No newline at end of file
@@ -0,0 +1,103 @@
+#include "internal/OtamThrottle.h"
+
+// The bucket holds at most this share of a second's worth of tokens
+const uint32_t THROTTLE_BURST_DIVIDER = 4;
+
+// Never let the bucket be smaller than one read from the socket
+const uint32_t THROTTLE_MIN_BURST = 1024;
+
+// Adaptive mode never backs off below this share of the configured cap
+const uint32_t THROTTLE_MIN_RATE_DIVIDER = 8;
+
+// How often the adaptive mode reconsiders the effective rate
+const unsigned long THROTTLE_ADAPT_INTERVAL_MS = 1000;
+
+// Set the bytes/s cap, 0 disables throttling
+void OtamThrottle::configure(uint32_t bytesPerSecond, bool adaptiveRate) {
+    rateLimit = bytesPerSecond;
+    adaptive = adaptiveRate && bytesPerSecond > 0;
+}
+
+// Signal application load, the adaptive mode backs off while busy
+void OtamThrottle::setApplicationBusy(bool busy) {
+    applicationBusy = busy;
+}
+
+// Reset the bucket and statistics at the start of a transfer
+void OtamThrottle::start() {
+    effectiveRate = rateLimit;
+    tokens = 0;
+    lastRefillAt = millis();
+    lastAdaptAt = lastRefillAt;
+    startedAt = lastRefillAt;
+
+    stats = OtamDownloadStats();
+    stats.rateLimit = rateLimit;
+    stats.minEffectiveRate = rateLimit;
+}
+
+// Halve the rate every interval while the application is busy, recover
+// gradually once it is idle again
+void OtamThrottle::adapt() {
+    unsigned long now = millis();
+    if (!adaptive || now - lastAdaptAt < THROTTLE_ADAPT_INTERVAL_MS) {
+        return;
+    }
+    lastAdaptAt = now;
+
+    uint32_t minRate = max(rateLimit / THROTTLE_MIN_RATE_DIVIDER, (uint32_t)1);
+    if (applicationBusy) {
+        effectiveRate = max(effectiveRate / 2, minRate);
+    } else {
+        effectiveRate = min(effectiveRate + minRate, rateLimit);
+    }
+
+    if (effectiveRate < stats.minEffectiveRate) {
+        stats.minEffectiveRate = effectiveRate;
+    }
+}
+
+void OtamThrottle::refill() {
+    unsigned long now = millis();
+    unsigned long elapsed = now - lastRefillAt;
+
+    uint32_t earned = (uint64_t)effectiveRate * elapsed / 1000;
+    if (earned == 0) {
+        return;
+    }
+    lastRefillAt = now;
+
+    uint32_t burst = max(effectiveRate / THROTTLE_BURST_DIVIDER, THROTTLE_MIN_BURST);
+    tokens = min(tokens + earned, burst);
+}
+
+// Wait until the bucket allows a transfer and return how many of the wanted
+// bytes may be read now
+size_t OtamThrottle::acquire(size_t wanted) {
+    if (rateLimit > 0) {
+        adapt();
+        refill();
+        while (tokens == 0) {
+            delay(1);
+            refill();
+        }
+        wanted = min(wanted, (size_t)tokens);
+        tokens -= wanted;
+    }
+
+    stats.bytes += wanted;
+    stats.durationMs = millis() - startedAt;
+    return wanted;
+}
+
+OtamDownloadStats OtamThrottle::getStats() {
+    if (stats.durationMs > 0) {
+        stats.achievedRate = (uint64_t)stats.bytes * 1000 / stats.durationMs;
+    }
+    return stats;
+}
+
+// Current bytes/s cap after adaptive back-off, 0 if unlimited
+uint32_t OtamThrottle::getEffectiveRate() {
+    return rateLimit > 0 ? effectiveRate : 0;
+}
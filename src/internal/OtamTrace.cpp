@@ -0,0 +1,55 @@
+#include "internal/OtamTrace.h"
+
+#if OTAM_ENABLE_TRACING
+
+OtamCallback<const OtamTraceRecord&> OtamTrace::sink = nullptr;
+OtamTraceRecord OtamTrace::records[OTAM_TRACE_BUFFER_SIZE];
+int OtamTrace::head = 0;
+int OtamTrace::count = 0;
+
+// Send every record to the sink instead of the ring buffer, nullptr restores the buffer
+void OtamTrace::setSink(OtamCallback<const OtamTraceRecord&> traceSink) {
+    sink = traceSink;
+}
+
+void OtamTrace::record(const OtamTraceRecord& traceRecord) {
+    if (sink) {
+        sink(traceRecord);
+        return;
+    }
+
+    // Overwrite the oldest record when the buffer is full
+    records[(head + count) % OTAM_TRACE_BUFFER_SIZE] = traceRecord;
+    if (count < OTAM_TRACE_BUFFER_SIZE) {
+        count++;
+    } else {
+        head = (head + 1) % OTAM_TRACE_BUFFER_SIZE;
+    }
+}
+
+// Move up to maxRecords buffered records, oldest first, into buffer
+int OtamTrace::read(OtamTraceRecord* buffer, int maxRecords) {
+    int copied = 0;
+    while (count > 0 && copied < maxRecords) {
+        buffer[copied++] = records[head];
+        head = (head + 1) % OTAM_TRACE_BUFFER_SIZE;
+        count--;
+    }
+    return copied;
+}
+
+OtamTraceScope::OtamTraceScope(const char* name) {
+    traceRecord.name = name;
+    traceRecord.freeHeapBefore = ESP.getFreeHeap();
+    traceRecord.startedAt = micros();
+}
+
+OtamTraceScope::~OtamTraceScope() {
+    traceRecord.duration = micros() - traceRecord.startedAt;
+    traceRecord.freeHeapAfter = ESP.getFreeHeap();
+    traceRecord.minFreeHeap = ESP.getMinFreeHeap();
+    traceRecord.maxAllocHeap = ESP.getMaxAllocHeap();
+    OtamTrace::record(traceRecord);
+}
+
+#endif
@@ -1,133 +1,352 @@
 #include "internal/OtamUpdater.h"
+#include "internal/OtamCapture.h"
+#include "internal/OtamTrace.h"
 
 // Add PROGMEM string constants at the top of the file after includes
 const char ERROR_WRITE[] PROGMEM = " - Write error occurred.";
-const char ERROR_ERASE[] PROGMEM = " - Erase error.";
-const char ERROR_READ[] PROGMEM = " - Read error occurred.";
-const char ERROR_SPACE[] PROGMEM = " - Insufficient space.";
 const char ERROR_SIZE[] PROGMEM = " - Firmware size mismatch.";
 const char ERROR_STREAM[] PROGMEM = " - Stream read timeout.";
 const char ERROR_MD5[] PROGMEM = " - MD5 check failed.";
-const char ERROR_MAGIC_BYTE[] PROGMEM = " - Magic byte mismatch.";
+const char ERROR_VALIDATE[] PROGMEM = " - Image validation failed.";
 const char ERROR_NO_PARTITION[] PROGMEM = " - No partition available.";
 const char ERROR_BAD_ARGUMENT[] PROGMEM = " - Invalid argument.";
+const char ERROR_NO_MEMORY[] PROGMEM = " - Out of memory.";
 const char ERROR_UNKNOWN[] PROGMEM = " - Unknown error.";
 const char ERROR_OTA_FAILED[] PROGMEM = "OTA failed. Error #: ";
 const char ERROR_NOT_ENOUGH_SPACE[] PROGMEM = "Not enough space to begin OTA.";
+const char ERROR_PREFLIGHT[] PROGMEM = "Pre-flight failed: ";
 
-void OtamUpdater::onOtaAfterDownload(CallbackType afterDownloadCallback) {
-    otaAfterDownloadCallback = afterDownloadCallback;
+// Size of the buffer used to move the firmware from the socket to flash
+const size_t OTA_BUFFER_SIZE = 1024;
+
+// Abort the download if the server sends nothing for this long
+const unsigned long OTA_STREAM_TIMEOUT_MS = 10000;
+
+// Window over which the download rate is compared against the minimum rate
+const unsigned long OTA_RATE_WINDOW_MS = 5000;
+
+OtamUpdater::~OtamUpdater() {
+    // Release the OTA handle if the download never completed
+    abortOta();
 }
 
-void OtamUpdater::onOtaDownloadProgress(NumberCallbackType progressCallback) {
+#if OTAM_ENABLE_CALLBACKS
+// Report download progress in percent to the application callback
+void OtamUpdater::onOtaDownloadProgress(const OtamCallback<int>* progressCallback) {
     otaDownloadProgressCallback = progressCallback;
 }
+#endif
 
-void OtamUpdater::onOtaSuccess(CallbackType successCallback) {
-    otaSuccessCallback = successCallback;
+// Limit the download rate so the application keeps its share of the link
+void OtamUpdater::setThrottle(OtamThrottle* downloadThrottle) {
+    throttle = downloadThrottle;
 }
 
-void OtamUpdater::onOtaError(StringCallbackType errorCallback) {
-    otaErrorCallback = errorCallback;
+String OtamUpdater::getUpdatePartitionLabel() {
+    return updatePartition ? String(updatePartition->label) : String("");
 }
 
-void OtamUpdater::runESP32Update(HTTPClient& http) {
-    int contentLength = http.getSize();  // Get the firmware size
-    // Serial.printf("Free heap: %u\n", ESP.getFreeHeap());
-    // Serial.printf("Total heap: %u\n", ESP.getHeapSize());
-    // Serial.printf("Free PSRAM: %u\n", ESP.getFreePsram());
-    Serial.println("Starting OTA Update...");
-    // Serial.println("Content Length: " + String(contentLength));
+size_t OtamUpdater::getWrittenSize() {
+    return writtenSize;
+}
 
-    if (contentLength <= 0) {
-        Serial.println("Invalid content length: " + String(contentLength));
-        // otaErrorCallback("Content length is invalid");
-        return;
+String OtamUpdater::otaErrorMessage(esp_err_t err) {
+    // Manually create human-readable error messages
+    String errorMessage = String(ERROR_OTA_FAILED) + String(err);
+    switch (err) {
+        case ESP_ERR_FLASH_OP_FAIL:
+        case ESP_ERR_FLASH_OP_TIMEOUT:
+            errorMessage += ERROR_WRITE;
+            break;
+        case ESP_ERR_INVALID_SIZE:
+            errorMessage += ERROR_SIZE;
+            break;
+        case ESP_ERR_OTA_VALIDATE_FAILED:
+            errorMessage += ERROR_VALIDATE;
+            break;
+        case ESP_ERR_NOT_FOUND:
+        case ESP_ERR_OTA_PARTITION_CONFLICT:
+            errorMessage += ERROR_NO_PARTITION;
+            break;
+        case ESP_ERR_INVALID_ARG:
+            errorMessage += ERROR_BAD_ARGUMENT;
+            break;
+        case ESP_ERR_NO_MEM:
+            errorMessage += ERROR_NO_MEMORY;
+            break;
+        default:
+            errorMessage += ERROR_UNKNOWN;
+            break;
     }
+    return errorMessage;
+}
 
-    bool canBegin = Update.begin(contentLength);  // Initialize OTA process
-    if (canBegin) {
-        // Serial.println("OTA Update initialized successfully.");
-        WiFiClient* client = http.getStreamPtr();  // Get the client stream
+// Open the inactive OTA partition for writing. With eraseUpFront the expected
+// image range is erased now, the whole partition for OTA_SIZE_UNKNOWN. Otherwise
+// sectors are erased as the data arrives so the socket is never left idle.
+bool OtamUpdater::beginOta(size_t expectedSize, bool eraseUpFront, String& error) {
+    updatePartition = esp_ota_get_next_update_partition(NULL);
+    if (!updatePartition) {
+        error = String(ERROR_OTA_FAILED) + String(ESP_ERR_NOT_FOUND) + ERROR_NO_PARTITION;
+        return false;
+    }
 
-        // Progress callback for logging the progress
-        Update.onProgress([this](size_t progress, size_t total) {
-            // Serial.printf("OTA Progress: %u of %u bytes\r\n", progress, total);
-            otaDownloadProgressCallback(progress / (total / 100));  // Callback with percentage
-        });
+    if (expectedSize != OTA_SIZE_UNKNOWN && expectedSize > updatePartition->size) {
+        error = ERROR_NOT_ENOUGH_SPACE;
+        return false;
+    }
 
-        // Write firmware data to flash
-        size_t written = Update.writeStream(*client);
-        Serial.println("Bytes written to flash: " + String(written));
+    esp_err_t err =
+        esp_ota_begin(updatePartition, eraseUpFront ? expectedSize : OTA_WITH_SEQUENTIAL_WRITES, &otaHandle);
+    if (err != ESP_OK) {
+        error = otaErrorMessage(err);
+        return false;
+    }
 
-        if (written != contentLength) {
-            Serial.println("Warning: Written bytes do not match content length.");
+    otaStarted = true;
+    preparedSize = eraseUpFront && expectedSize != OTA_SIZE_UNKNOWN ? expectedSize : updatePartition->size;
+    return true;
+}
+
+void OtamUpdater::abortOta() {
+    if (otaStarted) {
+        esp_ota_abort(otaHandle);
+        otaStarted = false;
+    }
+    writtenSize = 0;
+}
+
+// Validate the device can take the advertised image and erase the target
+// partition before any bytes are downloaded
+bool OtamUpdater::preflight(int imageSize, int minFreeHeap, String& error) {
+    OTAM_TRACE("OtamUpdater::preflight");
+    // OTAM_LOG("Free heap: " + String(ESP.getFreeHeap()));
+    // OTAM_LOG("Total heap: " + String(ESP.getHeapSize()));
+    // OTAM_LOG("Free PSRAM: " + String(ESP.getFreePsram()));
+
+    uint32_t freeHeap = ESP.getFreeHeap();
+    if (minFreeHeap > 0 && freeHeap < (uint32_t)minFreeHeap) {
+        error = String(ERROR_PREFLIGHT) + "free heap " + String(freeHeap) + " bytes is below the required " +
+                String(minFreeHeap) + " bytes.";
+        return false;
+    }
+
+    const esp_partition_t* partition = esp_ota_get_next_update_partition(NULL);
+    if (!partition) {
+        error = String(ERROR_PREFLIGHT) + "no OTA partition available.";
+        return false;
+    }
+
+    if (imageSize > 0 && (uint32_t)imageSize > partition->size) {
+        error = String(ERROR_PREFLIGHT) + "firmware size " + String(imageSize) +
+                " bytes exceeds OTA partition '" + partition->label + "' size " + String(partition->size) +
+                " bytes.";
+        return false;
+    }
+
+    OTAM_LOG("OTAM: Erasing OTA partition before download");
+
+    // Without an advertised size the whole partition is erased
+    String otaError = "";
+    if (!beginOta(imageSize > 0 ? (size_t)imageSize : OTA_SIZE_UNKNOWN, true, otaError)) {
+        error = String(ERROR_PREFLIGHT) + otaError;
+        return false;
+    }
+
+    return true;
+}
+
+// Prepare the inactive partition for an image of totalSize bytes. A download
+// that was interrupted continues at getWrittenSize if the size still matches.
+bool OtamUpdater::beginDownload(size_t totalSize, String& error) {
+    if (otaStarted && writtenSize > 0) {
+        if (totalSize != imageSize) {
+            error = String(ERROR_OTA_FAILED) + String(ESP_ERR_INVALID_SIZE) + ERROR_SIZE;
+            return false;
         }
+        return true;
+    }
+
+    if (otaStarted) {
+        // The pre-flight stage only erased room for the advertised image
+        if (totalSize > preparedSize) {
+            abortOta();
+            error = String(ERROR_OTA_FAILED) + String(ESP_ERR_INVALID_SIZE) + ERROR_SIZE;
+            return false;
+        }
+    } else if (!beginOta(totalSize, false, error)) {
+        return false;
+    }
 
-        if (Update.end()) {
-            // Download complete
-            otaAfterDownloadCallback();
-            if (Update.isFinished()) {
-                Serial.println("OTA Update finished successfully.");
-                otaSuccessCallback();  // Call success callback
-            } else {
-                Serial.println("OTA Update failed to complete.");
-                otaErrorCallback("OTA Update did not finish, something went wrong!");
+    // OTAM_LOG("OTA Update initialized successfully.");
+    imageSize = totalSize;
+    writtenSize = 0;
+
+    // Verify the image against the hash advertised by the server
+    md5.begin();
+
+    if (throttle) {
+        throttle->start();
+    }
+
+    return true;
+}
+
+// Write the response body to flash from the current offset. With a minRate
+// the stream is given up as slow when a rate window falls below it, the OTA
+// handle stays open so the download can continue from another source.
+OtamStreamResult OtamUpdater::writeStream(HTTPClient& http, uint32_t minRate, String& error) {
+    WiFiClient* client = http.getStreamPtr();  // Get the client stream
+
+    // Write firmware data to flash
+    uint8_t buffer[OTA_BUFFER_SIZE];
+    int lastProgress = -1;
+    unsigned long lastDataAt = millis();
+    unsigned long windowStartedAt = lastDataAt;
+    size_t windowStartSize = writtenSize;
+
+    while (writtenSize < imageSize) {
+        unsigned long windowDuration = millis() - windowStartedAt;
+        if (minRate > 0 && windowDuration >= OTA_RATE_WINDOW_MS) {
+            uint32_t rate = (uint64_t)(writtenSize - windowStartSize) * 1000 / windowDuration;
+
+            // Our own bandwidth cap does not count as a slow source
+            uint32_t throttleRate = throttle ? throttle->getEffectiveRate() : 0;
+            if (rate < minRate && (throttleRate == 0 || throttleRate > minRate)) {
+                OTAM_LOG("OTAM: Download rate " + String(rate) + " bytes/s below " + String(minRate) +
+                         " bytes/s");
+                return OTAM_STREAM_SLOW;
             }
-        } else {
-            // Log detailed error message
-            char errorMessage[128];
-            strcpy(errorMessage, ERROR_OTA_FAILED);
-            char errorNum[8];
-            itoa(Update.getError(), errorNum, 10);
-            strcat(errorMessage, errorNum);
-
-            // Print to Serial for more debugging info
-            Serial.print("Detailed Error: ");
-            Update.printError(Serial);  // Detailed error output
-
-            // Manually create human-readable error messages
-            switch (Update.getError()) {
-                case UPDATE_ERROR_WRITE:
-                    strcat(errorMessage, ERROR_WRITE);
-                    break;
-                case UPDATE_ERROR_ERASE:
-                    strcat(errorMessage, ERROR_ERASE);
-                    break;
-                case UPDATE_ERROR_READ:
-                    strcat(errorMessage, ERROR_READ);
-                    break;
-                case UPDATE_ERROR_SPACE:
-                    strcat(errorMessage, ERROR_SPACE);
-                    break;
-                case UPDATE_ERROR_SIZE:
-                    strcat(errorMessage, ERROR_SIZE);
-                    break;
-                case UPDATE_ERROR_STREAM:
-                    strcat(errorMessage, ERROR_STREAM);
-                    break;
-                case UPDATE_ERROR_MD5:
-                    strcat(errorMessage, ERROR_MD5);
-                    break;
-                case UPDATE_ERROR_MAGIC_BYTE:
-                    strcat(errorMessage, ERROR_MAGIC_BYTE);
-                    break;
-                case UPDATE_ERROR_NO_PARTITION:
-                    strcat(errorMessage, ERROR_NO_PARTITION);
-                    break;
-                case UPDATE_ERROR_BAD_ARGUMENT:
-                    strcat(errorMessage, ERROR_BAD_ARGUMENT);
-                    break;
-                default:
-                    strcat(errorMessage, ERROR_UNKNOWN);
-                    break;
+
+            windowStartedAt = millis();
+            windowStartSize = writtenSize;
+        }
+
+        size_t available = client->available();
+        if (available == 0) {
+            if (!client->connected() || millis() - lastDataAt > OTA_STREAM_TIMEOUT_MS) {
+                return OTAM_STREAM_INTERRUPTED;
             }
+            delay(1);
+            continue;
+        }
+
+        size_t toRead = min(available, min(OTA_BUFFER_SIZE, imageSize - writtenSize));
+        if (throttle) {
+            // Unread data stays in the socket and slows the sender down
+            toRead = throttle->acquire(toRead);
+        }
+        size_t bytesRead = client->readBytes(buffer, toRead);
+        if (bytesRead == 0) {
+            continue;
+        }
+        OTAM_CAPTURE(streamBody(buffer, bytesRead));
+        lastDataAt = millis();
+
+        esp_err_t err = esp_ota_write(otaHandle, buffer, bytesRead);
+        if (err != ESP_OK) {
+            abortOta();
+            // Log detailed error message
+            error = otaErrorMessage(err);
+            return OTAM_STREAM_FAILED;
+        }
+        md5.add(buffer, bytesRead);
+        writtenSize += bytesRead;
 
-            Serial.println(errorMessage);    // Print error message
-            otaErrorCallback(errorMessage);  // Send error callback
+        // Progress callback with percentage
+        int progress = (int)((uint64_t)writtenSize * 100 / imageSize);
+        if (progress != lastProgress) {
+            // OTAM_LOG("OTA Progress: " + String(writtenSize) + " of " + String(imageSize) + " bytes");
+            lastProgress = progress;
+#if OTAM_ENABLE_CALLBACKS
+            if (otaDownloadProgressCallback && *otaDownloadProgressCallback) {
+                (*otaDownloadProgressCallback)(progress);
+            }
+#endif
         }
-    } else {
-        Serial.println("Not enough space to begin OTA.");
-        otaErrorCallback(ERROR_NOT_ENOUGH_SPACE);
     }
-}
\ No newline at end of file
+
+    return OTAM_STREAM_COMPLETE;
+}
+
+// Check the complete image against the advertised hash and close the partition
+bool OtamUpdater::finishDownload(String expectedMd5, String& error) {
+    md5.calculate();
+    if (expectedMd5.length() == 32 && !md5.toString().equalsIgnoreCase(expectedMd5)) {
+        abortOta();
+        error = String(ERROR_OTA_FAILED) + String(ESP_ERR_INVALID_CRC) + ERROR_MD5;
+        OTAM_LOG(error);
+        return false;
+    }
+
+    // esp_ota_end validates the image and releases the handle
+    otaStarted = false;
+    esp_err_t err = esp_ota_end(otaHandle);
+    if (err != ESP_OK) {
+        // Log detailed error message
+        error = otaErrorMessage(err);
+        OTAM_LOG(error);  // Print error message
+        return false;
+    }
+
+    OTAM_LOG("OTA Update downloaded and verified.");
+    return true;
+}
+
+// Download the firmware into the inactive partition and verify it, the boot
+// partition is left untouched until activate is called
+bool OtamUpdater::runESP32Update(HTTPClient& http, String expectedMd5, String& error) {
+    OTAM_TRACE("OtamUpdater::runESP32Update");
+    int contentLength = http.getSize();  // Get the firmware size
+    OTAM_LOG("Starting OTA Update...");
+    // OTAM_LOG("Content Length: " + String(contentLength));
+
+    if (contentLength <= 0) {
+        OTAM_LOG("Invalid content length: " + String(contentLength));
+        error = "Content length is invalid";
+        return false;
+    }
+
+    // A complete download always starts at the beginning of the partition
+    if (writtenSize > 0) {
+        abortOta();
+    }
+
+    if (!beginDownload(contentLength, error)) {
+        OTAM_LOG(error);
+        return false;
+    }
+
+    OtamStreamResult result = writeStream(http, 0, error);
+
+    OTAM_LOG("Bytes written to flash: " + String(writtenSize));
+
+    if (result == OTAM_STREAM_FAILED) {
+        OTAM_LOG(error);
+        return false;
+    }
+
+    if (result != OTAM_STREAM_COMPLETE) {
+        OTAM_LOG("Warning: Written bytes do not match content length.");
+        abortOta();
+        error = String(ERROR_OTA_FAILED) + String(ESP_ERR_TIMEOUT) + ERROR_STREAM;
+        OTAM_LOG(error);
+        return false;
+    }
+
+    return finishDownload(expectedMd5, error);
+}
+
+// Boot the downloaded image on the next restart
+bool OtamUpdater::activate(String& error) {
+    OTAM_TRACE("OtamUpdater::activate");
+    esp_err_t err = updatePartition ? esp_ota_set_boot_partition(updatePartition) : ESP_ERR_NOT_FOUND;
+    if (err != ESP_OK) {
+        OTAM_LOG("OTA Update failed to complete.");
+        error = otaErrorMessage(err);
+        return false;
+    }
+
+    OTAM_LOG("OTA Update finished successfully.");
+    return true;
+}
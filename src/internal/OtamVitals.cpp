@@ -0,0 +1,127 @@
+#include "internal/OtamVitals.h"
+
+#if OTAM_ENABLE_VITALS
+
+#include <WiFi.h>
+#include <esp_ota_ops.h>
+#include <esp_system.h>
+#include "internal/OtamStore.h"
+
+static const OtamField vitalFields[OTAM_VITAL_COUNT] = {
+    OTAM_FIELD_FREE_HEAP,
+    OTAM_FIELD_MIN_FREE_HEAP,
+    OTAM_FIELD_RSSI,
+    OTAM_FIELD_UPTIME,
+    OTAM_FIELD_RESET_REASON,
+    OTAM_FIELD_RUNNING_FIRMWARE_FILE_ID,
+    OTAM_FIELD_PARTITION,
+};
+
+// Smallest change that is reported, 1 reports every change
+static const int32_t vitalThresholds[OTAM_VITAL_COUNT] = {
+    OTAM_VITALS_HEAP_THRESHOLD,
+    OTAM_VITALS_HEAP_THRESHOLD,
+    OTAM_VITALS_RSSI_THRESHOLD,
+    OTAM_VITALS_UPTIME_THRESHOLD,
+    1,
+    1,
+    1,
+};
+
+// Last values the server acknowledged, bit n of ackedMask is set once vital n has been acknowledged
+RTC_DATA_ATTR static int32_t ackedValues[OTAM_VITAL_COUNT];
+RTC_DATA_ATTR static char ackedPartition[17];
+RTC_DATA_ATTR static uint32_t ackedMask;
+
+// Read the vitals and mark those that moved beyond their threshold as pending
+void OtamVitals::collect() {
+    const esp_partition_t* runningPartition = esp_ota_get_running_partition();
+
+    pendingValues[OTAM_VITAL_FREE_HEAP] = ESP.getFreeHeap();
+    pendingValues[OTAM_VITAL_MIN_FREE_HEAP] = ESP.getMinFreeHeap();
+    pendingValues[OTAM_VITAL_RSSI] = WiFi.RSSI();
+    pendingValues[OTAM_VITAL_UPTIME] = millis() / 1000;
+    pendingValues[OTAM_VITAL_RESET_REASON] = esp_reset_reason();
+    pendingValues[OTAM_VITAL_FIRMWARE_FILE_ID] = OtamStore::readRunningFileIdFromStore();
+    pendingValues[OTAM_VITAL_PARTITION] = 0;
+    pendingPartition = runningPartition ? runningPartition->label : "";
+
+    pendingMask = 0;
+    for (int i = 0; i < OTAM_VITAL_COUNT; i++) {
+        bool changed;
+        if (!(ackedMask & (1 << i))) {
+            changed = true;
+        } else if (i == OTAM_VITAL_PARTITION) {
+            changed = pendingPartition != ackedPartition;
+        } else if (i == OTAM_VITAL_UPTIME && pendingValues[i] < ackedValues[i]) {
+            // The device rebooted
+            changed = true;
+        } else {
+            changed = abs(pendingValues[i] - ackedValues[i]) >= vitalThresholds[i];
+        }
+
+        if (changed) {
+            pendingMask |= 1 << i;
+        }
+    }
+}
+
+// Add the changed vitals to a request body
+void OtamVitals::addTo(OtamPayload& payload) {
+    collect();
+
+    for (int i = 0; i < OTAM_VITAL_COUNT; i++) {
+        if (!(pendingMask & (1 << i))) {
+            continue;
+        }
+
+        if (i == OTAM_VITAL_PARTITION) {
+            payload.add(vitalFields[i], pendingPartition);
+        } else {
+            payload.add(vitalFields[i], (int)pendingValues[i]);
+        }
+    }
+}
+
+// The changed vitals as a query string for a GET request, empty when nothing changed
+String OtamVitals::toQueryString() {
+    collect();
+
+    String query = "";
+    for (int i = 0; i < OTAM_VITAL_COUNT; i++) {
+        if (!(pendingMask & (1 << i))) {
+            continue;
+        }
+
+        query += query.length() == 0 ? "?" : "&";
+        query += OtamPayload::fieldName(vitalFields[i]);
+        query += "=";
+        if (i == OTAM_VITAL_PARTITION) {
+            query += pendingPartition;
+        } else {
+            query += pendingValues[i];
+        }
+    }
+    return query;
+}
+
+// The server received the last report, its vitals become the new reference
+void OtamVitals::acknowledge() {
+    for (int i = 0; i < OTAM_VITAL_COUNT; i++) {
+        if (!(pendingMask & (1 << i))) {
+            continue;
+        }
+
+        if (i == OTAM_VITAL_PARTITION) {
+            strncpy(ackedPartition, pendingPartition.c_str(), sizeof(ackedPartition) - 1);
+            ackedPartition[sizeof(ackedPartition) - 1] = '\0';
+        } else {
+            ackedValues[i] = pendingValues[i];
+        }
+    }
+
+    ackedMask |= pendingMask;
+    pendingMask = 0;
+}
+
+#endif
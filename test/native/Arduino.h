@@ -0,0 +1,90 @@
+#ifndef OTAM_TEST_ARDUINO_H
+#define OTAM_TEST_ARDUINO_H
+
+// Host stand-in for the parts of Arduino.h used by the code under test
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+class String {
+   private:
+    std::string value;
+
+   public:
+    String() {}
+    String(const char* text) : value(text ? text : "") {}
+    explicit String(uint32_t number) : value(std::to_string(number)) {}
+    explicit String(int number) : value(std::to_string(number)) {}
+    explicit String(long number) : value(std::to_string(number)) {}
+    bool concat(const char* text, unsigned int size) {
+        value.append(text, size);
+        return true;
+    }
+    const char* c_str() const { return value.c_str(); }
+    unsigned int length() const { return value.size(); }
+    char charAt(unsigned int index) const { return index < value.size() ? value[index] : 0; }
+    String substring(unsigned int from) const { return substring(from, value.size()); }
+    String substring(unsigned int from, unsigned int to) const {
+        String result;
+        if (from < to && from < value.size()) {
+            result.value = value.substr(from, to - from);
+        }
+        return result;
+    }
+    bool startsWith(const String& prefix) const {
+        return value.compare(0, prefix.value.size(), prefix.value) == 0;
+    }
+    bool endsWith(const String& suffix) const {
+        return value.size() >= suffix.value.size() &&
+               value.compare(value.size() - suffix.value.size(), suffix.value.size(), suffix.value) == 0;
+    }
+    bool reserve(unsigned int size) {
+        value.reserve(size);
+        return true;
+    }
+    String& operator+=(const String& other) {
+        value += other.value;
+        return *this;
+    }
+    String& operator+=(const char* text) {
+        value += text;
+        return *this;
+    }
+    String& operator+=(char character) {
+        value += character;
+        return *this;
+    }
+    String& operator+=(int number) {
+        value += std::to_string(number);
+        return *this;
+    }
+    bool operator==(const char* text) const { return value == text; }
+    friend String operator+(const String& left, const String& right) {
+        String result = left;
+        result += right;
+        return result;
+    }
+};
+
+inline char* itoa(int number, char* buffer, int base) {
+    snprintf(buffer, 12, base == 16 ? "%x" : "%d", number);
+    return buffer;
+}
+
+// Simulated clock, delay() advances it instantly
+inline unsigned long hostMillis = 0;
+inline unsigned long millis() {
+    return hostMillis;
+}
+inline void delay(unsigned long ms) {
+    hostMillis += ms;
+}
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+
+#endif  // OTAM_TEST_ARDUINO_H
@@ -0,0 +1,131 @@
+// Host tests of the CBOR encoder and parser: `pio test -e native`
+
+#include <unity.h>
+#include "internal/LightCbor.h"
+
+void setUp() {}
+
+void tearDown() {}
+
+// An indefinite length map closed by its break
+static bool isClosedMap(const uint8_t* data, size_t size) {
+    return size >= 2 && data[0] == 0xBF && data[size - 1] == 0xFF;
+}
+
+void test_round_trip() {
+    uint8_t buffer[64];
+    LightCborWriter writer(buffer, sizeof(buffer));
+    writer.beginMap();
+    writer.addInt(4);
+    writer.addString("UPDATE_PENDING");
+    writer.addInt(5);
+    writer.addInt(1234);
+    writer.addString("rssi");
+    writer.addInt(-67);
+    writer.addInt(15);
+    writer.beginArray();
+    writer.addString("http://a");
+    writer.addString("http://b");
+    writer.end();
+    writer.end();
+    TEST_ASSERT_TRUE(writer.ok());
+
+    TEST_ASSERT_EQUAL_STRING("UPDATE_PENDING",
+                             LightCbor::getValue(buffer, writer.size(), 4, "status").c_str());
+    TEST_ASSERT_EQUAL_INT(1234, LightCbor::getIntValue(buffer, writer.size(), 5, "firmwareFileId"));
+    TEST_ASSERT_EQUAL_INT(-67, LightCbor::getIntValue(buffer, writer.size(), 28, "rssi"));
+    TEST_ASSERT_EQUAL_STRING("http://b",
+                             LightCbor::getArrayItem(buffer, writer.size(), 15, nullptr, 1).c_str());
+    TEST_ASSERT_EQUAL_STRING("", LightCbor::getArrayItem(buffer, writer.size(), 15, nullptr, 2).c_str());
+    TEST_ASSERT_FALSE(LightCbor::hasKey(buffer, writer.size(), 9, "logMessage"));
+}
+
+void test_long_string_is_cut_short() {
+    uint8_t buffer[16];
+    LightCborWriter writer(buffer, sizeof(buffer));
+    writer.beginMap();
+    writer.addInt(9);
+    writer.addString("a message much longer than the buffer");
+    writer.end();
+    TEST_ASSERT_TRUE(writer.ok());
+    TEST_ASSERT_TRUE(isClosedMap(buffer, writer.size()));
+
+    TEST_ASSERT_EQUAL_STRING("a message mu", LightCbor::getValue(buffer, writer.size(), 9, nullptr).c_str());
+}
+
+void test_cut_keeps_utf8_characters_whole() {
+    uint8_t buffer[8];
+    LightCborWriter writer(buffer, sizeof(buffer));
+    writer.beginMap();
+    writer.addInt(9);
+    // Room for 4 bytes of text, the third character is two bytes wide
+    writer.addString("ab\xC3\xA9xyz");
+    writer.end();
+    TEST_ASSERT_TRUE(writer.ok());
+    TEST_ASSERT_EQUAL_STRING("ab\xC3\xA9", LightCbor::getValue(buffer, writer.size(), 9, nullptr).c_str());
+
+    uint8_t small[7];
+    LightCborWriter cut(small, sizeof(small));
+    cut.beginMap();
+    cut.addInt(9);
+    // Room for 3 bytes, the two byte character is dropped rather than split
+    cut.addString("ab\xC3\xA9xyz");
+    cut.end();
+    TEST_ASSERT_EQUAL_STRING("ab", LightCbor::getValue(small, cut.size(), 9, nullptr).c_str());
+}
+
+void test_overflow_rolls_back() {
+    uint8_t buffer[4];
+    LightCborWriter writer(buffer, sizeof(buffer));
+    writer.beginMap();
+    size_t mark = writer.size();
+    writer.addInt(5);
+    writer.addInt(100000);
+    TEST_ASSERT_FALSE(writer.ok());
+
+    writer.rollback(mark);
+    TEST_ASSERT_TRUE(writer.ok());
+    writer.end();
+    TEST_ASSERT_EQUAL_UINT(2, writer.size());
+    TEST_ASSERT_TRUE(isClosedMap(buffer, writer.size()));
+}
+
+void test_huge_text_length_is_rejected() {
+    // {4: text of length 0xFFFFFFFF}
+    const uint8_t body[] = {0xA1, 0x04, 0x7A, 0xFF, 0xFF, 0xFF, 0xFF, 'x'};
+    TEST_ASSERT_EQUAL_STRING("", LightCbor::getValue(body, sizeof(body), 4, nullptr).c_str());
+    TEST_ASSERT_FALSE(LightCbor::hasKey(body, sizeof(body), 5, nullptr));
+}
+
+void test_huge_key_length_is_rejected() {
+    // {text key of length 0xFFFFFFF0: 1, 5: 2}
+    const uint8_t body[] = {0xA2, 0x7A, 0xFF, 0xFF, 0xFF, 0xF0, 0x01, 0x05, 0x02};
+    TEST_ASSERT_FALSE(LightCbor::hasKey(body, sizeof(body), 5, "status"));
+    TEST_ASSERT_EQUAL_INT(0, LightCbor::getIntValue(body, sizeof(body), 5, nullptr));
+}
+
+void test_huge_array_item_is_rejected() {
+    // {15: [text of length 0xFFFFFFFF, "b"]}
+    const uint8_t body[] = {0xA1, 0x0F, 0x82, 0x7A, 0xFF, 0xFF, 0xFF, 0xFF, 0x61, 'b'};
+    TEST_ASSERT_EQUAL_STRING("", LightCbor::getArrayItem(body, sizeof(body), 15, nullptr, 1).c_str());
+}
+
+void test_truncated_body_is_rejected() {
+    // {4: 16 bit argument cut off}
+    const uint8_t body[] = {0xA1, 0x04, 0x19, 0x01};
+    TEST_ASSERT_EQUAL_INT(0, LightCbor::getIntValue(body, sizeof(body), 4, nullptr));
+    TEST_ASSERT_EQUAL_STRING("", LightCbor::getValue(body, 0, 4, nullptr).c_str());
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_round_trip);
+    RUN_TEST(test_long_string_is_cut_short);
+    RUN_TEST(test_cut_keeps_utf8_characters_whole);
+    RUN_TEST(test_overflow_rolls_back);
+    RUN_TEST(test_huge_text_length_is_rejected);
+    RUN_TEST(test_huge_key_length_is_rejected);
+    RUN_TEST(test_huge_array_item_is_rejected);
+    RUN_TEST(test_truncated_body_is_rejected);
+    return UNITY_END();
+}
@@ -0,0 +1,119 @@
+// Host tests of the download throttle: `pio test -e native`
+
+#include <unity.h>
+#include "internal/OtamThrottle.h"
+
+void setUp() {
+    hostMillis = 1000;
+}
+
+void tearDown() {}
+
+void test_unlimited_passes_everything() {
+    OtamThrottle throttle;
+    throttle.configure(0, false);
+    throttle.start();
+
+    TEST_ASSERT_EQUAL_UINT(100000, throttle.acquire(100000));
+    TEST_ASSERT_EQUAL_UINT(0, throttle.getEffectiveRate());
+}
+
+void test_refill_follows_the_rate() {
+    OtamThrottle throttle;
+    throttle.configure(4000, false);
+    throttle.start();
+
+    // 250 ms at 4000 bytes/s
+    delay(250);
+    TEST_ASSERT_EQUAL_UINT(1000, throttle.acquire(100000));
+
+    // An empty bucket waits for the next token
+    unsigned long before = millis();
+    TEST_ASSERT_EQUAL_UINT(4, throttle.acquire(100000));
+    TEST_ASSERT_EQUAL_UINT(1, millis() - before);
+}
+
+void test_burst_is_capped() {
+    OtamThrottle throttle;
+    throttle.configure(4000, false);
+    throttle.start();
+
+    // A quarter second of tokens, but never less than 1024
+    delay(10000);
+    TEST_ASSERT_EQUAL_UINT(1024, throttle.acquire(100000));
+
+    OtamThrottle fast;
+    fast.configure(40000, false);
+    fast.start();
+    delay(10000);
+    TEST_ASSERT_EQUAL_UINT(10000, fast.acquire(100000));
+}
+
+void test_adaptive_backs_off_and_recovers() {
+    OtamThrottle throttle;
+    throttle.configure(8000, true);
+    throttle.start();
+    throttle.setApplicationBusy(true);
+
+    // Halved every second, down to an eighth of the cap
+    uint32_t expected[] = {4000, 2000, 1000, 1000};
+    for (uint32_t rate : expected) {
+        delay(1000);
+        throttle.acquire(1);
+        TEST_ASSERT_EQUAL_UINT(rate, throttle.getEffectiveRate());
+    }
+
+    // Recovers by an eighth of the cap per second once idle
+    throttle.setApplicationBusy(false);
+    delay(1000);
+    throttle.acquire(1);
+    TEST_ASSERT_EQUAL_UINT(2000, throttle.getEffectiveRate());
+
+    TEST_ASSERT_EQUAL_UINT(1000, throttle.getStats().minEffectiveRate);
+}
+
+void test_adaptive_off_keeps_the_cap() {
+    OtamThrottle throttle;
+    throttle.configure(8000, false);
+    throttle.start();
+    throttle.setApplicationBusy(true);
+
+    delay(3000);
+    throttle.acquire(1);
+    TEST_ASSERT_EQUAL_UINT(8000, throttle.getEffectiveRate());
+}
+
+void test_stats() {
+    OtamThrottle throttle;
+    throttle.configure(0, false);
+    throttle.start();
+
+    throttle.acquire(500);
+    delay(1000);
+    throttle.acquire(1500);
+
+    OtamDownloadStats stats = throttle.getStats();
+    TEST_ASSERT_EQUAL_UINT(2000, stats.bytes);
+    TEST_ASSERT_EQUAL_UINT(1000, stats.durationMs);
+    TEST_ASSERT_EQUAL_UINT(2000, stats.achievedRate);
+    TEST_ASSERT_EQUAL_UINT(0, stats.rateLimit);
+
+    // A new transfer starts with fresh statistics
+    throttle.configure(4000, false);
+    throttle.start();
+    stats = throttle.getStats();
+    TEST_ASSERT_EQUAL_UINT(0, stats.bytes);
+    TEST_ASSERT_EQUAL_UINT(4000, stats.rateLimit);
+    TEST_ASSERT_EQUAL_UINT(4000, stats.minEffectiveRate);
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_unlimited_passes_everything);
+    RUN_TEST(test_refill_follows_the_rate);
+    RUN_TEST(test_burst_is_capped);
+    RUN_TEST(test_adaptive_backs_off_and_recovers);
+    RUN_TEST(test_adaptive_off_keeps_the_cap);
+    RUN_TEST(test_stats);
+    return UNITY_END();
+}
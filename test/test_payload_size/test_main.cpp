@@ -0,0 +1,182 @@
+// Host benchmark of the JSON and compact (CBOR) encodings of the OTAM
+// payloads: `pio test -e native -f test_payload_size -v` prints the table
+
+#include <unity.h>
+#include <chrono>
+#include "internal/OtamPayload.h"
+
+const int BENCHMARK_ROUNDS = 20000;
+
+void setUp() {}
+
+void tearDown() {}
+
+// Initialization request of OtamDevice
+static void buildInitRequest(OtamPayload& payload) {
+    payload.add(OTAM_FIELD_DEVICE_ID, "a4cf12f0b3e8");
+    payload.add(OTAM_FIELD_DEVICE_GUID, "6f1d0c2e-3b7a-4d5e-9c8f-1a2b3c4d5e6f");
+    payload.add(OTAM_FIELD_DEVICE_PROFILE_ID, 12);
+}
+
+// UPDATE_SUCCESS report with download and mirror statistics
+static void buildSuccessReport(OtamPayload& payload) {
+    payload.add(OTAM_FIELD_DEVICE_STATUS, "UPDATE_SUCCESS");
+    payload.add(OTAM_FIELD_FIRMWARE_FILE_ID, 4711);
+    payload.add(OTAM_FIELD_FIRMWARE_ID, 42);
+    payload.add(OTAM_FIELD_FIRMWARE_VERSION, "2.14.3");
+    payload.add(OTAM_FIELD_DOWNLOAD_RATE, 48213);
+    payload.add(OTAM_FIELD_DOWNLOAD_RATE_LIMIT, 65536);
+    payload.beginArray(OTAM_FIELD_MIRROR_STATS);
+    for (int i = 0; i < 2; i++) {
+        payload.beginObject();
+        payload.add(OTAM_FIELD_MIRROR_RANK, i);
+        payload.add(OTAM_FIELD_TIME_TO_FIRST_BYTE, 180 + i * 95);
+        payload.add(OTAM_FIELD_DOWNLOAD_BYTES, 1048576 - i * 524288);
+        payload.add(OTAM_FIELD_DOWNLOAD_RATE, 51200 - i * 20000);
+        payload.end();
+    }
+    payload.end();
+    payload.add(OTAM_FIELD_SEQUENCE, 1093);
+}
+
+// Sync request with vitals and queued log messages
+static void buildSyncRequest(OtamPayload& payload) {
+    buildInitRequest(payload);
+    payload.add(OTAM_FIELD_FREE_HEAP, 182344);
+    payload.add(OTAM_FIELD_MIN_FREE_HEAP, 141208);
+    payload.add(OTAM_FIELD_RSSI, -67);
+    payload.add(OTAM_FIELD_UPTIME, 86400);
+    payload.add(OTAM_FIELD_PARTITION, "app1");
+    payload.beginArray(OTAM_FIELD_LOGS);
+    payload.addItem("Sensor calibration done");
+    payload.addItem("MQTT reconnected after 3 attempts");
+    payload.addItem("Battery 3.71 V");
+    payload.end();
+}
+
+// UPDATE_PENDING status reply as the server sends it
+static void buildStatusReply(OtamPayload& payload) {
+    payload.add(OTAM_FIELD_DEVICE_STATUS, "UPDATE_PENDING");
+    payload.add(OTAM_FIELD_FIRMWARE_FILE_ID, 4711);
+    payload.add(OTAM_FIELD_FIRMWARE_ID, 42);
+    payload.add(OTAM_FIELD_FIRMWARE_NAME, "greenhouse-controller");
+    payload.add(OTAM_FIELD_FIRMWARE_VERSION, "2.14.3");
+    payload.add(OTAM_FIELD_FIRMWARE_FILE_URL, "/firmware-files/4711/download?token=9f8e7d6c5b4a");
+    payload.add(OTAM_FIELD_FIRMWARE_FILE_SIZE, 1048576);
+    payload.add(OTAM_FIELD_FIRMWARE_FILE_HASH, "0cc175b9c0f1b6a831c399e269772661");
+    payload.add(OTAM_FIELD_FIRMWARE_FILE_URL_EXPIRES_IN, 300);
+}
+
+struct EncodingResult {
+    size_t size;
+    double encodeMicros;
+    double decodeMicros;
+};
+
+static EncodingResult measure(void (*build)(OtamPayload&), bool compact) {
+    OtamPayload::compactEncoding = compact;
+    EncodingResult result = {};
+
+    auto started = std::chrono::steady_clock::now();
+    for (int i = 0; i < BENCHMARK_ROUNDS; i++) {
+        OtamPayload payload;
+        build(payload);
+        result.size = payload.size();
+    }
+    auto encoded = std::chrono::steady_clock::now();
+
+    OtamPayload payload;
+    build(payload);
+    String body;
+    body.concat((const char*)payload.data(), payload.size());
+    OtamPayloadReader reader(body, compact);
+    // Kept so the lookups are not optimized away
+    volatile int found = 0;
+    for (int i = 0; i < BENCHMARK_ROUNDS; i++) {
+        found += reader.hasKey(OTAM_FIELD_FIRMWARE_FILE_ID) ? 1 : 0;
+        found += reader.getValue(OTAM_FIELD_DEVICE_STATUS).length() > 0 ? 1 : 0;
+    }
+    auto decoded = std::chrono::steady_clock::now();
+
+    result.encodeMicros =
+        std::chrono::duration<double, std::micro>(encoded - started).count() / BENCHMARK_ROUNDS;
+    result.decodeMicros =
+        std::chrono::duration<double, std::micro>(decoded - encoded).count() / BENCHMARK_ROUNDS;
+    return result;
+}
+
+static void compare(const char* name, void (*build)(OtamPayload&)) {
+    EncodingResult json = measure(build, false);
+    EncodingResult cbor = measure(build, true);
+    OtamPayload::compactEncoding = false;
+
+    char line[160];
+    snprintf(line, sizeof(line),
+             "%-16s json %4zu B %6.2f us enc %6.2f us dec | cbor %4zu B %6.2f us enc %6.2f us dec", name,
+             json.size, json.encodeMicros, json.decodeMicros, cbor.size, cbor.encodeMicros,
+             cbor.decodeMicros);
+    TEST_MESSAGE(line);
+
+    TEST_ASSERT_TRUE(cbor.size < json.size);
+    TEST_ASSERT_TRUE(cbor.size <= OTAM_PAYLOAD_BUFFER_SIZE);
+}
+
+void test_init_request() {
+    compare("init request", buildInitRequest);
+}
+
+void test_success_report() {
+    compare("success report", buildSuccessReport);
+}
+
+void test_sync_request() {
+    compare("sync request", buildSyncRequest);
+}
+
+void test_status_reply() {
+    compare("status reply", buildStatusReply);
+}
+
+// Both encodings carry the same values
+void test_encodings_agree() {
+    for (bool compact : {false, true}) {
+        OtamPayload::compactEncoding = compact;
+        OtamPayload payload;
+        buildStatusReply(payload);
+        String body;
+        body.concat((const char*)payload.data(), payload.size());
+
+        OtamPayloadReader reader(body, compact);
+        TEST_ASSERT_EQUAL_STRING("UPDATE_PENDING", reader.getValue(OTAM_FIELD_DEVICE_STATUS).c_str());
+        TEST_ASSERT_EQUAL_INT(1048576, reader.getIntValue(OTAM_FIELD_FIRMWARE_FILE_SIZE));
+        TEST_ASSERT_EQUAL_STRING("0cc175b9c0f1b6a831c399e269772661",
+                                 reader.getValue(OTAM_FIELD_FIRMWARE_FILE_HASH).c_str());
+    }
+    OtamPayload::compactEncoding = false;
+}
+
+// Quotes, backslashes and control characters in JSON strings are escaped
+void test_json_strings_are_escaped() {
+    OtamPayload::compactEncoding = false;
+    OtamPayload payload;
+    payload.add(OTAM_FIELD_MESSAGE, "say \"hi\"\\");
+    payload.beginArray(OTAM_FIELD_LOGS);
+    payload.addItem("line\nnext\t\x01");
+    payload.end();
+
+    String body;
+    body.concat((const char*)payload.data(), payload.size());
+    TEST_ASSERT_EQUAL_STRING("{\"message\":\"say \\\"hi\\\"\\\\\",\"logs\":[\"line\\nnext\\t\\u0001\"]}",
+                             body.c_str());
+}
+
+int main() {
+    UNITY_BEGIN();
+    RUN_TEST(test_init_request);
+    RUN_TEST(test_success_report);
+    RUN_TEST(test_sync_request);
+    RUN_TEST(test_status_reply);
+    RUN_TEST(test_encodings_agree);
+    RUN_TEST(test_json_strings_are_escaped);
+    return UNITY_END();
+}
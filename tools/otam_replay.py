@@ -0,0 +1,152 @@
+#!/usr/bin/env python3
+"""Serve a capture recorded with OtamCapture back to an OTAM client.
+
+Exchanges are answered in the order they were recorded, with the original
+delays between request, response headers and every body read, optionally
+sped up. Point OtamConfig.url at this server to replay a field session:
+
+    python3 tools/otam_replay.py session.cap --port 8080 --speed 4
+
+With --rewrite-urls, firmware and mirror urls in the responses are pointed at
+--public-url, the address of this machine as seen from the device.
+
+API responses are always recorded whole. Firmware reads recorded without
+bodies are replayed as zero bytes of the same size, so firmware hash checks
+only pass when the capture contains the bodies.
+"""
+
+import argparse
+import re
+import struct
+import sys
+import time
+from http.server import BaseHTTPRequestHandler, HTTPServer
+from urllib.parse import urlsplit
+
+MAGIC = b"OTAMCAP"
+REQUEST, RESPONSE, BODY, END = 1, 2, 3, 4
+
+
+def read_capture(path):
+    """Return the recorded exchanges as a list of dicts."""
+    with open(path, "rb") as capture:
+        data = capture.read()
+    if not data.startswith(MAGIC) or len(data) < len(MAGIC) + 1:
+        sys.exit("%s is not an OTAM capture" % path)
+    if data[len(MAGIC)] != 1:
+        sys.exit("unsupported capture version %d" % data[len(MAGIC)])
+
+    exchanges = []
+    exchange = None
+    offset = len(MAGIC) + 1
+    while offset + 9 <= len(data):
+        kind, at, length = struct.unpack_from("<BII", data, offset)
+        payload = data[offset + 9:offset + 9 + length]
+        offset += 9 + length
+
+        if kind == REQUEST:
+            method, url, body = payload.split(b"\0", 2)
+            exchange = {"method": method.decode(), "path": urlsplit(url.decode()).path, "at": at,
+                        "body": body, "status": 0, "headers": [], "reads": []}
+        elif exchange is None:
+            continue
+        elif kind == RESPONSE:
+            status, length = struct.unpack_from("<ii", payload)
+            exchange["status"] = status
+            exchange["length"] = length
+            exchange["response_at"] = at
+            for line in payload[8:].decode().splitlines():
+                name, _, value = line.partition(": ")
+                exchange["headers"].append((name, value))
+        elif kind == BODY:
+            (size,) = struct.unpack_from("<I", payload)
+            exchange["reads"].append((at, payload[4:] if len(payload) > 4 else bytes(size)))
+        elif kind == END:
+            exchanges.append(exchange)
+            exchange = None
+    return exchanges
+
+
+class ReplayHandler(BaseHTTPRequestHandler):
+    protocol_version = "HTTP/1.1"
+
+    def replay(self):
+        server = self.server
+        length = int(self.headers.get("Content-Length", 0))
+        if length:
+            self.rfile.read(length)
+
+        if server.next >= len(server.exchanges):
+            self.send_error(410, "Capture exhausted")
+            return
+        exchange = server.exchanges[server.next]
+        server.next += 1
+
+        if exchange["method"] != self.command or exchange["path"] != self.path.split("?")[0]:
+            self.log_message("expected %s %s, replaying it anyway", exchange["method"], exchange["path"])
+
+        # A transport error on the device, there is nothing to send
+        if exchange["status"] <= 0:
+            self.close_connection = True
+            return
+
+        last = exchange.get("response_at", exchange["at"])
+        self.wait(last - exchange["at"])
+
+        body = b"".join(read for _, read in exchange["reads"])
+        if server.rewrite:
+            body = server.rewrite.sub(server.base_url.encode(), body)
+
+        self.send_response(exchange["status"])
+        for name, value in exchange["headers"]:
+            self.send_header(name, value)
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+
+        # Rewritten bodies change size, they are sent in one piece
+        if server.rewrite:
+            self.wfile.write(body)
+            return
+
+        for at, read in exchange["reads"]:
+            self.wait(at - last)
+            last = at
+            self.wfile.write(read)
+            self.wfile.flush()
+
+    def wait(self, ms):
+        if ms > 0 and self.server.speed > 0:
+            time.sleep(ms / 1000.0 / self.server.speed)
+
+    do_GET = replay
+    do_POST = replay
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("capture", help="file written by OtamCapture")
+    parser.add_argument("--host", default="0.0.0.0")
+    parser.add_argument("--port", type=int, default=8080)
+    parser.add_argument("--speed", type=float, default=1.0,
+                        help="timing factor, 2 replays twice as fast, 0 without delays")
+    parser.add_argument("--rewrite-urls", action="store_true",
+                        help="point absolute http(s) urls in response bodies at --public-url")
+    parser.add_argument("--public-url",
+                        help="address the device reaches this server at, e.g. http://192.168.1.20:8080")
+    args = parser.parse_args()
+    if args.rewrite_urls and not args.public_url:
+        parser.error("--rewrite-urls needs --public-url, the device can not reach the listen address")
+
+    server = HTTPServer((args.host, args.port), ReplayHandler)
+    server.exchanges = read_capture(args.capture)
+    server.next = 0
+    server.speed = args.speed
+    server.base_url = (args.public_url or "").rstrip("/")
+    server.rewrite = re.compile(rb"https?://[^/\"\s]+") if args.rewrite_urls else None
+
+    print("Replaying %d exchanges on port %d" % (len(server.exchanges), args.port))
+    server.serve_forever()
+
+
+if __name__ == "__main__":
+    main()